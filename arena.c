@@ -0,0 +1,80 @@
+/*
+ * arena.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains a bump allocator for the many small, short lived
+ * allocations of a check. Memory comes from large talloc chunks and is only
+ * given back all at once, by freeing the arena.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;	/* [SYN] older chunks */
+	size_t size;			/* [SYN] usable bytes after the header */
+	size_t used;
+};
+
+/* [SYN] Room taken by the chunk header, so data stays aligned */
+#define ARENA_HEADER ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena *arena_new(TALLOC_CTX *mem_ctx, size_t chunk_size)
+{
+	struct arena *arena;
+
+	arena = talloc_zero(mem_ctx, struct arena);
+	if (!arena) {
+		return NULL;
+	}
+	arena->chunk_size = chunk_size ? chunk_size : 65536;
+	return arena;
+}
+
+/* [SYN] Returns size zeroed bytes, which live until the arena is freed */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	uint8_t *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = arena->chunk_size;
+
+		/* [SYN] Oversized requests get a chunk of their own */
+		if (chunk_size < size) {
+			chunk_size = size;
+		}
+		chunk = talloc_size(arena, ARENA_HEADER + chunk_size);
+		if (!chunk) {
+			return NULL;
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	ptr = (uint8_t *)chunk + ARENA_HEADER + chunk->used;
+	chunk->used += size;
+	arena->allocs++;
+	memset(ptr, 0, size);
+	return ptr;
+}
@@ -0,0 +1,280 @@
+/*
+ * batch.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains batch mode: many hives are checked in one process, a
+ * number of them at the same time, with a summary line per hive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+struct batch_hive {
+	const char *path;
+	int status;
+	uint32_t cells;
+	TALLOC_CTX *mem_ctx;		/* [SYN] holds the report until printed */
+	struct report_buf *out;
+	int done;
+};
+
+struct batch_job {
+	struct batch_hive *hives;
+	uint32_t count;
+	uint32_t next;			/* [SYN] next hive to hand out */
+	uint32_t printed;		/* [SYN] hives printed so far */
+	int verbose;
+	pthread_mutex_t lock;
+};
+
+struct batch_paths {
+	const char **paths;
+	uint32_t count;
+	uint32_t alloc;
+};
+
+static int add_path(TALLOC_CTX *mem_ctx, struct batch_paths *list, const char *path)
+{
+	if (list->count == list->alloc) {
+		uint32_t alloc = list->alloc ? list->alloc * 2 : 64;
+		const char **paths;
+
+		paths = talloc_realloc(mem_ctx, list->paths, const char *, alloc);
+		if (!paths) {
+			return 0;
+		}
+		list->paths = paths;
+		list->alloc = alloc;
+	}
+	if (!(list->paths[list->count] = talloc_strdup(mem_ctx, path))) {
+		return 0;
+	}
+	list->count++;
+	return 1;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* [SYN] Add the regular files in a directory, sorted by name */
+static int add_directory(TALLOC_CTX *mem_ctx, struct batch_paths *list, const char *dirname)
+{
+	struct dirent *entry;
+	uint32_t first = list->count;
+	DIR *dir;
+
+	if (!(dir = opendir(dirname))) {
+		return add_path(mem_ctx, list, dirname);
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		struct stat st;
+		char *path;
+
+		path = talloc_asprintf(mem_ctx, "%s/%s", dirname, entry->d_name);
+		if (!path) {
+			closedir(dir);
+			return 0;
+		}
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+			if (!add_path(mem_ctx, list, path)) {
+				closedir(dir);
+				return 0;
+			}
+		}
+		talloc_free(path);
+	}
+	closedir(dir);
+	qsort(&list->paths[first], list->count - first, sizeof(const char *),
+			compare_paths);
+	return 1;
+}
+
+static int add_listfile(TALLOC_CTX *mem_ctx, struct batch_paths *list, const char *listfile)
+{
+	FILE *fd;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int rv = 1;
+
+	if (strcmp(listfile, "-") == 0) {
+		fd = stdin;
+	} else if (!(fd = fopen(listfile, "r"))) {
+		printf("Error: cannot open %s: %s\n", listfile, strerror(errno));
+		return 0;
+	}
+	while ((len = getline(&line, &size, fd)) != -1) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+			line[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (!add_path(mem_ctx, list, line)) {
+			printf("Memory allocation error\n");
+			rv = 0;
+			break;
+		}
+	}
+	free(line);
+	if (fd != stdin) {
+		fclose(fd);
+	}
+	return rv;
+}
+
+/* [SYN] Print the hives that are done, in the order they were given. Called
+ * with the lock held. */
+static void batch_print(struct batch_job *job)
+{
+	while (job->printed < job->count && job->hives[job->printed].done) {
+		struct batch_hive *h = &job->hives[job->printed];
+
+		if (job->verbose && h->out) {
+			report_flush(h->out);
+		}
+		if (report_get_format() == REPORT_JSON) {
+			report_status(h->path, check_status_name(h->status), h->cells);
+		} else {
+			printf("%s: %s, %lu cells\n", h->path,
+					check_status_name(h->status),
+					(unsigned long)h->cells);
+		}
+		if (h->mem_ctx) {
+			talloc_free(h->mem_ctx);
+			h->mem_ctx = NULL;
+		}
+		job->printed++;
+	}
+	fflush(stdout);
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch_job *job = arg;
+
+	for (;;) {
+		uint32_t n = __sync_fetch_and_add(&job->next, 1);
+		struct batch_hive *h;
+		struct report_buf *saved;
+
+		if (n >= job->count) {
+			break;
+		}
+		h = &job->hives[n];
+
+		/* [SYN] Every hive has a talloc tree of its own */
+		h->mem_ctx = talloc_new(NULL);
+		h->out = h->mem_ctx ? report_buf_new(h->mem_ctx) : NULL;
+		if (!h->out) {
+			h->status = CHECK_NOMEM;
+		} else {
+			saved = report_set_buffer(h->out);
+			h->status = check_hive(h->mem_ctx, h->path, 1, &h->cells);
+			report_set_buffer(saved);
+		}
+
+		pthread_mutex_lock(&job->lock);
+		h->done = 1;
+		batch_print(job);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+int check_batch(TALLOC_CTX *mem_ctx, const char **paths, int count,
+		const char *listfile, int jobs, int verbose)
+{
+	struct batch_paths list;
+	struct batch_job job;
+	pthread_t *threads;
+	uint32_t i, counts[4];
+	int started, rv = CHECK_OK;
+
+	memset(&list, 0, sizeof(list));
+	for (i = 0; i < count; i++) {
+		if (!add_directory(mem_ctx, &list, paths[i])) {
+			printf("Memory allocation error\n");
+			return CHECK_NOMEM;
+		}
+	}
+	if (listfile && !add_listfile(mem_ctx, &list, listfile)) {
+		return CHECK_NOFILE;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.count = list.count;
+	job.verbose = verbose;
+	job.hives = talloc_zero_array(mem_ctx, struct batch_hive, list.count + 1);
+	threads = talloc_array(mem_ctx, pthread_t, jobs);
+	if (!job.hives || !threads) {
+		printf("Memory allocation error\n");
+		return CHECK_NOMEM;
+	}
+	for (i = 0; i < list.count; i++) {
+		job.hives[i].path = list.paths[i];
+	}
+	pthread_mutex_init(&job.lock, NULL);
+
+	for (started = 0; started < jobs && started < list.count; started++) {
+		if (pthread_create(&threads[started], NULL, batch_worker, &job) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		batch_worker(&job);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&job.lock);
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < list.count; i++) {
+		counts[job.hives[i].status]++;
+		if (job.hives[i].status > rv) {
+			rv = job.hives[i].status;
+		}
+	}
+	if (report_get_format() == REPORT_JSON) {
+		printf("{\"hives\": %lu, \"ok\": %lu, \"errors\": %lu, "
+				"\"cannot_open\": %lu, \"out_of_memory\": %lu}\n",
+				(unsigned long)list.count, (unsigned long)counts[CHECK_OK],
+				(unsigned long)counts[CHECK_ERRORS],
+				(unsigned long)counts[CHECK_NOFILE],
+				(unsigned long)counts[CHECK_NOMEM]);
+	} else {
+		printf("Checked %lu hives: %lu ok, %lu with errors, %lu could not be opened",
+				(unsigned long)list.count, (unsigned long)counts[CHECK_OK],
+				(unsigned long)counts[CHECK_ERRORS],
+				(unsigned long)counts[CHECK_NOFILE]);
+		if (counts[CHECK_NOMEM]) {
+			printf(", %lu out of memory", (unsigned long)counts[CHECK_NOMEM]);
+		}
+		printf("\n");
+	}
+
+	talloc_free(threads);
+	talloc_free(job.hives);
+	return rv;
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# bench.sh  --  Time chkregf on generated hives of increasing size
+#
+# Licensed under the GNU GPL v2 or any later version
+#
+# Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+#
+# Generates hives from 1 MB up to 2 GB with genhive, checks each of them
+# with chkregf -t and prints the time, cells/s and MB/s of pass 1 to 3.
+# BENCH_MAX=3221225472 adds a 3 GB hive, past where 32 bit offsets wrap;
+# genhive keeps the whole hive in memory while writing it.
+#
+# Environment:
+#   BENCH_DIR    where the hives are kept between runs (default /tmp/chkregf-bench)
+#   BENCH_MAX    largest hive in bytes (default 2147483648)
+#   BENCH_JOBS   passed to chkregf -j (default 1)
+#   BENCH_RUNS   runs per hive, the fastest one counts (default 3)
+#   GENHIVE_OPTS extra genhive options, e.g. "-l lh -r 512 -F 10 -s 20000"
+#
+
+BENCH_DIR=${BENCH_DIR:-/tmp/chkregf-bench}
+BENCH_MAX=${BENCH_MAX:-2147483648}
+BENCH_JOBS=${BENCH_JOBS:-1}
+BENCH_RUNS=${BENCH_RUNS:-3}
+
+SIZES="1048576 4194304 16777216 67108864 268435456 1073741824 2147483648 3221225472"
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+# [SYN] The options are part of the name, a different shape gets new files
+tag=`echo "$GENHIVE_OPTS" | tr -c 'a-zA-Z0-9\n' '_'`
+
+printf "%10s %10s %5s %10s %10s %10s\n" size cells pass time cells/s MB/s
+for size in $SIZES; do
+	if [ "$size" -gt "$BENCH_MAX" ]; then
+		break
+	fi
+	hive="$BENCH_DIR/bench-$size$tag.hive"
+	if [ ! -f "$hive" ]; then
+		./genhive -m "$size" $GENHIVE_OPTS "$hive" 2>/dev/null || exit 1
+	fi
+
+	best=""
+	run=0
+	while [ $run -lt "$BENCH_RUNS" ]; do
+		line=`./chkregf -t -j "$BENCH_JOBS" "$hive" | grep '^Timing:'`
+		if [ -z "$line" ]; then
+			echo "chkregf failed on $hive" >&2
+			exit 1
+		fi
+		# [SYN] Keep the run with the lowest total
+		best=`echo "$line
+$best" | awk -F'[ ,]+' 'NF > 1 {
+			t = $8 + $12 + $16
+			if (min == "" || t < min) { min = t; keep = $0 }
+		} END { print keep }'`
+		run=`expr $run + 1`
+	done
+
+	echo "$best" | awk -F'[ ,]+' '{
+		bytes = $2; cells = $4
+		for (p = 1; p <= 3; p++) {
+			t = $(4 + 4 * p)
+			if (t <= 0) t = 1e-9
+			printf "%10d %10d %5d %10.4f %10.0f %10.1f\n", bytes, cells, p, \
+				t, cells / t, bytes / t / 1048576
+		}
+	}'
+done
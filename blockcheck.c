@@ -15,18 +15,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <talloc.h>
+#include <pthread.h>
 #include "regf.h"
 #include "chkregf.h"
 #include "config.h"
 
-int parse_sk (uint8_t *data, int size, long int offset)
+int parse_sk (struct hive *hive, uint8_t *data, int size, hive_off_t offset)
 {
 	struct sk_record *sk;
 
+	if (!record_fits(RECORD_SK, size, offset+0x1000, 0)) {
+		return 0;
+	}
+
 	sk = (struct sk_record *) data;
 	
 	/* [SYN] If one of sk prev/next offset points to self, it means there
@@ -34,7 +40,8 @@ int parse_sk (uint8_t *data, int size, long int offset)
 	 * should point to self as well. */
 	if ((sk->prev_sk_offset == offset || sk->next_sk_offset == offset) &&
 			sk->prev_sk_offset != sk->next_sk_offset) {
-		printf("Error: One sk offset points to self, the other doesn't. (0x%lx)\n",
+		diag(DIAG_SK_SELF, offset+0x1000, 0, RECORD_SK,
+				"One sk offset points to self, the other doesn't. (0x%lx)\n",
 				offset+0x1000);
 		return 0;
 	}
@@ -44,31 +51,37 @@ int parse_sk (uint8_t *data, int size, long int offset)
 	 * should never be 0 or -1 */
 	if (sk->prev_sk_offset == -1 || sk->next_sk_offset == -1 ||
 			sk->prev_sk_offset == 0 || sk->next_sk_offset == 0) {
-		printf("Error: illegal prev/next sk offset. (0x%lx)\n",
+		diag(DIAG_SK_LINK, offset+0x1000, 0, RECORD_SK,
+				"illegal prev/next sk offset. (0x%lx)\n",
 				offset+0x1000);
 		return 0;
 	}
 	
 	/* [SYN] Size check, can't stretch beyond end of data block */
 	if (sk->size > size - 0x10) {
-		printf("Error: sk size value stretches beyond end of hbin data block (0x%lx)\n",
+		diag(DIAG_SK_SIZE, offset+0x1000, 0, RECORD_SK,
+				"sk size value stretches beyond end of hbin data block (0x%lx)\n",
 				offset+0x1000);
 		return 0;
 	}
 	return 1;
 }
 
-int parse_vk (uint8_t *data, int size, uint32_t offset)
+int parse_vk (struct hive *hive, uint8_t *data, int size, hive_off_t offset)
 {
 	struct vk_record *vk;
-	uint32_t data_length;
 	
 	vk = (struct vk_record *) data;
 
+	if (!record_fits(RECORD_VK, size, offset+0x1000, 0)) {
+		return 0;
+	}
+
 	/* [SYN] Name length shouldn't be larger than the block->size minus 
 	 * header size. */ 
 	if (vk->name_length > size - 0x14) {
-		printf("Error: Value name length too high (0x%lx)\n",
+		diag(DIAG_VK_NAME_LENGTH, offset+0x1000, 0, RECORD_VK,
+				"Value name length too high (0x%lx)\n",
 				(long)offset+0x1000);
 		return 0;
 	}
@@ -76,59 +89,67 @@ int parse_vk (uint8_t *data, int size, uint32_t offset)
 	/* [SYN] If bit 31 of the data length is set, the data is in the offset
 	 * field itself. Locate it and strip it, if necessary. */
 	if (vk->data_length & 0x80000000) {
-		/* [SYN] Strip bit 31 */
-		data_length = vk->data_length ^ 0x80000000;
-		
 		/* [SYN] No point in checking the offset, because it's data. */
 		
 	} else if (vk->data_offset == 0 || vk->data_offset == -1) {
-		printf("Error: Invalid data offset at vk record (0x%lx)\n",
+		diag(DIAG_VK_DATA_OFFSET, offset+0x1000, 0, RECORD_VK,
+				"Invalid data offset at vk record (0x%lx)\n",
 				(long)offset+0x1000);
 		return 0;
 	}
 #if DODEBUG > 0
 	if (vk->type == REG_NONE) {
-		printf("Warning: You have a REG_NONE key (0x%lx)\n",
+		diag(DIAG_VK_REG_NONE, offset+0x1000, 0, RECORD_VK,
+				"You have a REG_NONE key (0x%lx)\n",
 				(long)offset+0x1000);
 	}
 #endif
 	/* [SYN] I know of only 12 data types (0x0 to 0xB) */
 	if (vk->type > 0xB) {
-		printf("Warning: You have an unknown value type (0x%lx) 0x%lx\n",
+		diag(DIAG_VK_TYPE, offset+0x1000, 0, RECORD_VK,
+				"You have an unknown value type (0x%lx) 0x%lx\n",
 				(long)vk->type, (long)offset+0x1000);
 	}
 #if DODEBUG > 0
 	if (vk->flag != 0x0 && vk->flag != 0x1) {
-		printf("DEBUG: You have a vk flag (0x%x) set (0x%lx)\n",
+		diag(DIAG_VK_FLAG, offset+0x1000, 0, RECORD_VK,
+				"You have a vk flag (0x%x) set (0x%lx)\n",
 				vk->flag, (long)offset+0x1000);
 	}
 #endif
 	return 1;
 }
 
-int parse_ri (uint8_t *_ri_ptr, int size, long int offset)
+int parse_ri (struct hive *hive, uint8_t *_ri_ptr, int size, hive_off_t offset)
 {
 	struct li_record *ri;
 	uint16_t i;
 	ri = (struct li_record *) _ri_ptr;
 
+	if (!record_fits(RECORD_RI, size, offset+0x1000, 0)) {
+		return 0;
+	}
+
 	if (ri->key_count > (size - 8) / 4) {
-		printf("Size doesn't match offset count (0x%lx)!\n",
+		diag(DIAG_LIST_SIZE, offset+0x1000, 0, RECORD_RI,
+				"Size doesn't match offset count (0x%lx)!\n",
 				(long)offset+0x1000);
 		return 0;
 	}
 	if (ri->key_count == 0 || ri->key_count == 0xFFFF) {
-		printf("No offset count (0x%lx)!\n",
+		diag(DIAG_LIST_EMPTY, offset+0x1000, 0, RECORD_RI,
+				"No offset count (0x%lx)!\n",
 				offset+0x1000);
 		return 0;
 	}
 	for (i = 0;i < ri->key_count; i++) {
 		struct ri_record_data *data;
 		
-		data = (struct ri_record_data *) &ri->data;
+		data = (struct ri_record_data *) &ri->data + i;
 
-		if (data->offset <= 0) {
-			printf("No valid offset (0x%lx) in this ri record (0x%lx)\n",
+		if (data->offset == 0 || data->offset == -1) {
+			diag(DIAG_LIST_OFFSET, offset+0x1000, 0, RECORD_RI,
+					"No valid offset (0x%lx) in this ri record (0x%lx)\n",
 					(long)data->offset, (long)offset+0x1000);
 			return 0;
 		}
@@ -136,29 +157,35 @@ int parse_ri (uint8_t *_ri_ptr, int size, long int offset)
 	return 1;
 }
 
-int parse_li (uint8_t *_li_ptr, int size, long int offset)
+int parse_li (struct hive *hive, uint8_t *_li_ptr, int size, hive_off_t offset)
 {
 	struct li_record *li;
 	uint16_t i;
 	li = (struct li_record *) _li_ptr;
-	
-	if (li->key_count > (size - 8) / 8) {
-		printf("Size doesn't match key count (0x%lx)!\n",
+
+	if (!record_fits(RECORD_LI, size, offset+0x1000, 0)) {
+		return 0;
+	}
+	if (li->key_count > (size - 8) / 4) {
+		diag(DIAG_LIST_SIZE, offset+0x1000, 0, RECORD_LI,
+				"Size doesn't match key count (0x%lx)!\n",
 				offset+0x1000);
 		return 0;
 	}
 	if (li->key_count == 0 || li->key_count == 0xFFFF) {
-		printf("No key count (0x%lx)!\n",
+		diag(DIAG_LIST_EMPTY, offset+0x1000, 0, RECORD_LI,
+				"No key count (0x%lx)!\n",
 				offset+0x1000);
 		return 0;
 	}
 	for (i = 0;i < li->key_count; i++) {
 		struct li_record_data *data;
 		
-		data = (struct li_record_data *) &li->data;
+		data = (struct li_record_data *) &li->data + i;
 
-		if (data->offset <= 0) {
-			printf("No valid offset (0x%lx) in this li record (0x%lx)\n",
+		if (data->offset == 0 || data->offset == -1) {
+			diag(DIAG_LIST_OFFSET, offset+0x1000, 0, RECORD_LI,
+					"No valid offset (0x%lx) in this li record (0x%lx)\n",
 					(long)data->offset, (long)offset+0x1000);
 			return 0;
 		}
@@ -167,38 +194,46 @@ int parse_li (uint8_t *_li_ptr, int size, long int offset)
 }
 
 
-int parse_lh (uint8_t *_lh_ptr, int size, long int offset)
+int parse_lh (struct hive *hive, uint8_t *_lh_ptr, int size, hive_off_t offset)
 {
 	struct lh_record *lh;
 	struct regf_block *regf;
 	uint16_t i;
 	lh = (struct lh_record *) _lh_ptr;
 
-	regf = get_regf_struct();
+	if (!record_fits(RECORD_LH, size, offset+0x1000, 0)) {
+		return 0;
+	}
+
+	regf = &hive->regf;
 	
 	/* [SYN] 1.3.0.1 registries should not contain lh records. Those were
 	 * introduced in 1.5.0.1 (Windows XP) */
-	if (regf->version[1] == '3') {
-		printf("lh records should not exist in windows NT4/2k registries (0x%lx)",
+	if (regf->version[1] == 3) {
+		diag(DIAG_LH_VERSION, offset+0x1000, 0, RECORD_LH,
+				"lh records should not exist in windows NT4/2k registries (0x%lx)\n",
 				offset+0x1000);
 	}
 	if (lh->key_count > (size - 8) / 8) {
-		printf("Size doesn't match key count (0x%lx)!\n",
+		diag(DIAG_LIST_SIZE, offset+0x1000, 0, RECORD_LH,
+				"Size doesn't match key count (0x%lx)!\n",
 				offset+0x1000);
 		return 0;
 	}
 	if (lh->key_count == 0 || lh->key_count == 0xFFFF) {
-		printf("No key count (0x%lx)!\n",
+		diag(DIAG_LIST_EMPTY, offset+0x1000, 0, RECORD_LH,
+				"No key count (0x%lx)!\n",
 				offset+0x1000);
 		return 0;
 	}
 	for (i = 0;i < lh->key_count; i++) {
 		struct lh_record_data *data;
 		
-		data = (struct lh_record_data *) &lh->data;
+		data = (struct lh_record_data *) &lh->data + i;
 
-		if (data->offset <= 0) {
-			printf("No valid offset (0x%lx) in this lh record (0x%lx)\n",
+		if (data->offset == 0 || data->offset == -1) {
+			diag(DIAG_LIST_OFFSET, offset+0x1000, 0, RECORD_LH,
+					"No valid offset (0x%lx) in this lh record (0x%lx)\n",
 					(long)data->offset, (long)offset+0x1000);
 			return 0;
 		}
@@ -207,29 +242,36 @@ int parse_lh (uint8_t *_lh_ptr, int size, long int offset)
 }
 
 
-int parse_lf (uint8_t *_lf_ptr, int size, long int offset)
+int parse_lf (struct hive *hive, uint8_t *_lf_ptr, int size, hive_off_t offset)
 {
 	struct lf_record *lf;
 	uint16_t i;
 	lf = (struct lf_record *) _lf_ptr;
 
+	if (!record_fits(RECORD_LF, size, offset+0x1000, 0)) {
+		return 0;
+	}
+
 	if (lf->key_count > (size - 8) / 8) {
-		printf("Size doesn't match key count (0x%lx)!\n",
+		diag(DIAG_LIST_SIZE, offset+0x1000, 0, RECORD_LF,
+				"Size doesn't match key count (0x%lx)!\n",
 				offset+0x1000);
 		return 0;
 	}
 	if (lf->key_count == 0 || lf->key_count == 0xFFFF) {
-		printf("No key count (0x%lx)!\n",
+		diag(DIAG_LIST_EMPTY, offset+0x1000, 0, RECORD_LF,
+				"No key count (0x%lx)!\n",
 				offset+0x1000);
 		return 0;
 	}
 	for (i = 0;i < lf->key_count; i++) {
 		struct lf_record_data *data;
 		
-		data = (struct lf_record_data *) &lf->data;
+		data = (struct lf_record_data *) &lf->data + i;
 
-		if (data->offset <= 0) {
-			printf("No valid offset (0x%lx) in this lf record (0x%lx)\n",
+		if (data->offset == 0 || data->offset == -1) {
+			diag(DIAG_LIST_OFFSET, offset+0x1000, 0, RECORD_LF,
+					"No valid offset (0x%lx) in this lf record (0x%lx)\n",
 					(long)data->offset, (long)offset+0x1000);
 			return 0;
 		}
@@ -237,110 +279,120 @@ int parse_lf (uint8_t *_lf_ptr, int size, long int offset)
 	return 1;
 }
 
-int parse_nk (TALLOC_CTX *mem_ctx, uint8_t *data, int size, long int offset)
+int parse_nk (struct hive *hive, uint8_t *data, int size, hive_off_t offset)
 {
 	struct nk_record *nk;
 	struct regf_block *regf;
-#if DODEBUG > 2
-	char *keyname;
-#endif
 	
-	regf = get_regf_struct();
+	regf = &hive->regf;
+
+	if (!record_fits(RECORD_NK, size, offset+0x1000, 0)) {
+		return 0;
+	}
 
 	nk = (struct nk_record *) data;
 
 	if (nk->keyname_length > size - 0x4C) {
-		printf("Error: Too long keyname length value (0x%lx).\n", 
+		diag(DIAG_NK_NAME_LENGTH, offset+0x1000, 0, RECORD_NK,
+				"Too long keyname length value (0x%lx).\n", 
 				offset+0x1000);
 		return 0;
 	}
 #if DODEBUG > 2
-	keyname = talloc_strndup(mem_ctx, (char *) &nk->keyname, nk->keyname_length);
-	if (!keyname) {
-		printf("Allocating %ld bytes of memory failed.\n",
-				(long)nk->keyname_length);
-		return 0;
-	}
-	printf("Parsing nk of %s\n", keyname);
-	talloc_free(keyname);
+	report("Parsing nk of %.*s\n", nk->keyname_length, (char *) &nk->keyname);
 #endif
 	/* [SYN] 0x20 = normal nk, 0x2C = root nk, 0x10 is sym-linked nk */
 	if (nk->type != 0x20 && nk->type != 0x2C && nk->type != 0x10) {
-		printf("Warning: this key is of unknown (%x) type (0x%lx)\n", 
+		diag(DIAG_NK_TYPE, offset+0x1000, 0, RECORD_NK,
+				"this key is of unknown (%x) type (0x%lx)\n", 
 				nk->type, offset+0x1000);
 	}
 	/* [SYN] There can be only one! */
 	if (nk->type == 0x2C && offset != regf->key_offset) {
-		printf("Error: Encountered unexpected root key. (0x%lx)\n",
+		diag(DIAG_NK_ROOT, offset+0x1000, 0, RECORD_NK,
+				"Encountered unexpected root key. (0x%lx)\n",
 				offset+0x1000);
 	} 
 	/* [SYN] If it has no parent and isn't a root key, something is wrong. */
 	if (nk->parent_offset == 0x00 && nk->type != 0x2C) {
-		printf("Error: this key has no parent and is no root key (0x%lx)\n",
+		diag(DIAG_NK_NO_PARENT, offset+0x1000, 0, RECORD_NK,
+				"this key has no parent and is no root key (0x%lx)\n",
 				offset+0x1000);
 		return 0;
 	}
 	/* [SYN] Check if there are subkeys without a subkey listing specified. */
 	if (nk->subkey_count > 0 && nk->subkey_offset == -1) {
-		printf("Error: this key has subkeys, but no listing (0x%lx)\n",
+		diag(DIAG_NK_SUBKEY_LIST, offset+0x1000, 0, RECORD_NK,
+				"this key has subkeys, but no listing (0x%lx)\n",
 				offset+0x1000);
 		return 0;
 	}
 	/* [SYN] Check for illegal NULL offsets */
 	if (nk->subkey_offset == 0x00 || nk->value_offset == 0x00 || nk->classname_offset == 0x00) {
-		printf("Error: this key has a 0x00 offset, this is illegal (0x%lx)\n",
+		diag(DIAG_NK_ZERO_OFFSET, offset+0x1000, 0, RECORD_NK,
+				"this key has a 0x00 offset, this is illegal (0x%lx)\n",
 				offset+0x1000);
 		return 0;
 	}
 	/* [SYN] Check for a classname */
 	if (nk->classname_length > 0 && nk->classname_offset == -1) {
-		printf("Error: this key has a class name length, but no offset (0x%lx)\n",
+		diag(DIAG_NK_CLASS_NAME, offset+0x1000, 0, RECORD_NK,
+				"this key has a class name length, but no offset (0x%lx)\n",
 				offset+0x1000);
 		return 0;
 	}
 #if DODEBUG > 0
 	if (nk->uk3 != 0 && nk->uk3 != -1) {
-		printf("DEBUG: strange value at unknown 3 (0x%lx)\n",
+		diag(DIAG_NK_UNKNOWN, offset+0x1000, 0, RECORD_NK,
+				"strange value at unknown 3 (0x%lx)\n",
 				offset+0x1000);
 	}
 #endif
 #if DODEBUG > 2
 	if (nk->classname_offset != -1 || nk->classname_length > 0) {
-		printf("DEBUG: Class name offset found at (0x%lx)\n",
+		diag(DIAG_NK_UNKNOWN, offset+0x1000, 0, RECORD_NK,
+				"Class name offset found at (0x%lx)\n",
 				offset+0x1000);
 	}
 #endif
 	/* [SYN] Check for values without listing */
 	if (nk->value_count > 0 && nk->value_offset == -1) {
-		printf("Error: this key has values, but no listing (0x%lx)\n",
+		diag(DIAG_NK_VALUE_LIST, offset+0x1000, 0, RECORD_NK,
+				"this key has values, but no listing (0x%lx)\n",
 				offset+0x1000);
 		return 0;
 	}
 	/* [SYN] sk record is mandatory */
 	if (nk->sk_offset == -1 || nk->sk_offset == 0) {
-		printf("Error: this key has no sk record (0x%lx)!\n",
+		diag(DIAG_NK_NO_SK, offset+0x1000, 0, RECORD_NK,
+				"this key has no sk record (0x%lx)!\n",
 				offset+0x1000);
 		return 0;
 	}
 #if DODEBUG > 2
 	if (nk->uk4[0] != 0x00) {
-		printf("DEBUG: 0x0034: Abnormal value (0x%08lx) at unknown 4 [0] (0x%lx)\n",
+		diag(DIAG_NK_UNKNOWN, offset+0x1000, 0, RECORD_NK,
+				"0x0034: Abnormal value (0x%08lx) at unknown 4 [0] (0x%lx)\n",
 				(long)nk->uk4[0], offset+0x1000);
 	}
 	if (nk->uk4[1] != 0x00) {
-		printf("DEBUG: 0x0038: Abnormal value (0x%08lx) at unknown 4 [1] (0x%lx)\n",
+		diag(DIAG_NK_UNKNOWN, offset+0x1000, 0, RECORD_NK,
+				"0x0038: Abnormal value (0x%08lx) at unknown 4 [1] (0x%lx)\n",
 				(long)nk->uk4[1], offset+0x1000);
 	}
 	if (nk->uk4[2] != 0x00) {
-		printf("DEBUG: 0x003C: Abnormal value (0x%08lx) at unknown 4 [2] (0x%lx)\n",
+		diag(DIAG_NK_UNKNOWN, offset+0x1000, 0, RECORD_NK,
+				"0x003C: Abnormal value (0x%08lx) at unknown 4 [2] (0x%lx)\n",
 				(long)nk->uk4[2], offset+0x1000);
 	}
 	if (nk->uk4[3] != 0x00) {
-		printf("DEBUG: 0x0040: Abnormal value (0x%08lx) at unknown 4 [3] (0x%lx)\n",
+		diag(DIAG_NK_UNKNOWN, offset+0x1000, 0, RECORD_NK,
+				"0x0040: Abnormal value (0x%08lx) at unknown 4 [3] (0x%lx)\n",
 				(long)nk->uk4[3], offset+0x1000);
 	}
 	if (nk->uk4[4] != 0x00) {
-		printf("DEBUG: 0x0044: Abnormal value (0x%08lx) at unknown 4 [4] (0x%lx)\n",
+		diag(DIAG_NK_UNKNOWN, offset+0x1000, 0, RECORD_NK,
+				"0x0044: Abnormal value (0x%08lx) at unknown 4 [4] (0x%lx)\n",
 				(long)nk->uk4[4], offset+0x1000);
 	}
 #endif
@@ -348,82 +400,366 @@ int parse_nk (TALLOC_CTX *mem_ctx, uint8_t *data, int size, long int offset)
 }
 
 
-int read_blocks (TALLOC_CTX *parent_ctx, FILE *fd, int32_t offset)
+int parse_db (struct hive *hive, uint8_t *data, int size, hive_off_t offset)
 {
-	int32_t cur_offset;
-	struct regf_block *regf;
-	int succes = 1;
-	TALLOC_CTX *mem_ctx;
+	struct db_record *db;
 
-	mem_ctx = talloc_new(parent_ctx);
-	if (!mem_ctx) {
-		printf("Memory allocation error\n");
+	if (!record_fits(RECORD_DB, size, offset+0x1000, 0)) {
 		return 0;
 	}
-	
-	regf = get_regf_struct();
+	db = (struct db_record *) data;
 
-	/* [SYN] Set index to data block */
-	cur_offset = offset + regf->key_offset;
+	/* [SYN] Anything that fits in one segment is stored in one cell */
+	if (db->segment_count < 2) {
+		diag(DIAG_DB_SEGMENTS, offset+0x1000, 0, RECORD_DB,
+				"db record has %ld segments, expected at least 2 (0x%lx)\n",
+				(long)db->segment_count, offset+0x1000);
+		return 0;
+	}
+	if (db->segment_offset == 0 || db->segment_offset == -1) {
+		diag(DIAG_DB_LIST_OFFSET, offset+0x1000, 0, RECORD_DB,
+				"Invalid segment list offset in db record (0x%lx)\n",
+				offset+0x1000);
+		return 0;
+	}
+	return 1;
+}
+
+/* [SYN] Decode the signature of a cell, data has at least 2 bytes */
+enum record_kind record_kind(const uint8_t *data)
+{
+	uint16_t id;
+
+	memcpy(&id, data, sizeof(id));
+	switch (id) {
+		case 0x6B6E: /* [SYN] nk */
+			return RECORD_NK;
+		case 0x6B73: /* [SYN] sk */
+			return RECORD_SK;
+		case 0x6B76: /* [SYN] vk */
+			return RECORD_VK;
+		case 0x666C: /* [SYN] lf */
+			return RECORD_LF;
+		case 0x686C: /* [SYN] lh */
+			return RECORD_LH;
+		case 0x696C: /* [SYN] li */
+			return RECORD_LI;
+		case 0x6972: /* [SYN] ri */
+			return RECORD_RI;
+		case 0x6264: /* [SYN] db */
+			return RECORD_DB;
+		default:
+			return RECORD_UNKNOWN;
+	}
+}
 
-	/* [SYN] Seek to data block */
-	fseek(fd, cur_offset+0x1000, SEEK_SET);
+/* [SYN] Size of the fixed part of each record, up to the first field of
+ * variable length. The cell has to hold at least that much. */
+static const uint32_t record_header_sizes[RECORD_KINDS] = {
+	[RECORD_NK] = offsetof(struct nk_record, keyname),
+	[RECORD_SK] = offsetof(struct sk_record, data),
+	[RECORD_VK] = offsetof(struct vk_record, name),
+	[RECORD_LF] = offsetof(struct lf_record, data),
+	[RECORD_LH] = offsetof(struct lh_record, data),
+	[RECORD_LI] = offsetof(struct li_record, data),
+	[RECORD_RI] = offsetof(struct ri_record, data),
+	[RECORD_DB] = sizeof(struct db_record),
+};
+
+/* [SYN] Check that a cell of size bytes, size field included, holds the
+ * fixed part of its record, before any of it is read. offset and
+ * parent_off are as for diag(). */
+int record_fits(enum record_kind kind, int size, hive_off_t offset, hive_off_t parent_off)
+{
+	if (size >= 4 + (int)record_header_sizes[kind]) {
+		return 1;
+	}
+	diag(DIAG_CELL_TOO_SMALL, offset, parent_off, kind,
+			"%s record too small (0x%lx bytes) at 0x%lx\n",
+			record_kind_name(kind), (long)size, (long)offset);
+	return 0;
+}
 
+/* [SYN] Pass 2 checks per kind of record. Cells without a signature can't
+ * be checked on their own, pass 3 gets to them. */
+typedef int (*block_parser)(struct hive *hive, uint8_t *data, int size, hive_off_t offset);
+
+static const block_parser block_parsers[RECORD_KINDS] = {
+	[RECORD_NK] = parse_nk,
+	[RECORD_SK] = parse_sk,
+	[RECORD_VK] = parse_vk,
+	[RECORD_LF] = parse_lf,
+	[RECORD_LH] = parse_lh,
+	[RECORD_LI] = parse_li,
+	[RECORD_RI] = parse_ri,
+	[RECORD_DB] = parse_db,
+};
+
+/* [SYN] Index the cells of the hbin, all of its pages. Their records are
+ * checked too, unless parse is 0. */
+int read_blocks (struct hive *hive, struct cell_index *index,
+		const struct hbin_entry *hbin, int parse)
+{
+	hive_off_t cur_offset, end;
+	int succes = 1;
+	int scan = hbin->recovered;	/* [SYN] search for cells, see recover.c */
+	uint64_t kinds[RECORD_KINDS], free_cells = 0, bytes = 0, found = 0;
+	int i;
 	
-	while (cur_offset < offset+0x1000) {
-		struct hbin_data_block *block;
-		uint16_t *record_type;
+	memset(kinds, 0, sizeof(kinds));
+
+	/* [SYN] The cells follow the hbin header and fill up the hbin */
+	cur_offset = hive_off_add(hbin->offset, sizeof(struct hbin_block));
+	end = hive_off_add(hbin->offset, hbin->size);
+	if (scan) {
+		cur_offset = recover_next_cell(hive, hbin->offset, end);
+	}
+
+	while (cur_offset >= 0 && cur_offset < end) {
+		struct hbin_data_block block;
+		enum record_kind kind;
 		
-		block = get_hbin_data_block(mem_ctx, fd, cur_offset, 0);
-		if (!block) {
-			talloc_free(mem_ctx);
-			return 0;
+		if (!get_hbin_data_block(hive, cur_offset, 0, &block)) {
+			succes = 0;
+			if (!hive->recover) {
+				break;
+			}
+			scan = 1;
+			cur_offset = recover_next_cell(hive, cur_offset + 8, end);
+			continue;
 		}
-		if (block->size < 0) {
+		/* [SYN] Cells don't span hbins, Windows frees hbins as a whole */
+		if ((block.size < 0 ? -block.size : block.size) > end - cur_offset) {
+			diag(DIAG_CELL_HBIN_END, cur_offset+0x1000, 0, RECORD_UNKNOWN,
+					"Block at 0x%lx with size 0x%lx runs past the end of the hbin at 0x%lx\n",
+					(long)cur_offset+0x1000,
+					(long)(block.size < 0 ? -block.size : block.size),
+					(long)end+0x1000);
+			succes = 0;
+			if (!hive->recover) {
+				break;
+			}
+			scan = 1;
+			cur_offset = recover_next_cell(hive, cur_offset + 8, end);
+			continue;
+		}
+		if (block.size < 0) {
 			/* Unused block */
-			cur_offset += -block->size;
-			talloc_free(block);
+			if (!cell_index_add(index, cur_offset, -block.size, 0, 0)) {
+				succes = 0;
+				break;
+			}
+			free_cells++;
+			bytes += -block.size;
+			cur_offset = hive_off_add(cur_offset, -block.size);
 			continue;
 		} 
 		
 		/* [SYN] Get the record type and parse/check it accordingly. */
-		record_type = (uint16_t *) block->data;
-	
-		switch (*record_type) {
-			case 0x6B6E: /* [SYN] nk */
-				succes &= parse_nk(mem_ctx, block->data, block->size, cur_offset);
-				
-				break;
-			case 0x684C: /* [SYN] lh */
-				succes &= parse_lh(block->data, block->size, cur_offset);
-				break;
-			case 0x666C: /* [SYN] lf */
-				succes &= parse_lf(block->data, block->size, cur_offset);
-				break;
-			case 0x696C: /* [SYN] li */
-				succes &= parse_li(block->data, block->size, cur_offset);
-				break;
-			case 0x6972: /* [SYN] ri */
-				succes &= parse_ri(block->data, block->size, cur_offset);
-				break;
-			case 0x6B76: /* [SYN] vk */
-				succes &= parse_vk(block->data, block->size, cur_offset);
-				break;
-			case 0x6B73: /* [SYN] sk */
-				succes &= parse_sk(block->data, block->size, cur_offset);
-				break;
-			default:
-				break;
+		kind = block.size >= 6 ? record_kind(block.data) : RECORD_UNKNOWN;
+
+		/* [SYN] Remember the cell for pass 3 */
+		if (!cell_index_add(index, cur_offset, block.size, kind, 1)) {
+			succes = 0;
+			break;
+		}
+		kinds[kind]++;
+		bytes += block.size;
+		if (parse && block_parsers[kind]) {
+			succes &= block_parsers[kind](hive, block.data, block.size, cur_offset);
+		}
+		cur_offset = hive_off_add(cur_offset, block.size);
+		if (scan) {
+			found++;
+			cur_offset = recover_next_cell(hive, cur_offset, end);
+		}
+	}
+
+	/* [SYN] Several hbins may be read at once, add the counts in one go */
+	for (i = 0; i < RECORD_KINDS; i++) {
+		if (kinds[i]) {
+			__atomic_add_fetch(&hive->stats.cells[i], kinds[i], __ATOMIC_RELAXED);
 		}
-		talloc_free(block);
-		cur_offset+=block->size;
-		fseek(fd, cur_offset+0x1000, SEEK_SET);
+	}
+	__atomic_add_fetch(&hive->stats.free_cells, free_cells, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hive->stats.cell_bytes, bytes, __ATOMIC_RELAXED);
+	if (found) {
+		__atomic_add_fetch(&hive->recovered_cells, found, __ATOMIC_RELAXED);
 	}
 
-	talloc_free(mem_ctx);
 	if (!succes) {
 		return 0;
 	}
 	return (1);
 }
 
+
+/* [SYN] Pass 2 in parallel: the hbins are handed out in batches to a pool of
+ * workers. Every batch has its own output buffer and cell index, which are
+ * merged in file order afterwards, so the result is that of a sequential
+ * run. */
+struct block_batch {
+	uint32_t first;			/* [SYN] first hbin in the list */
+	uint32_t count;			/* [SYN] number of hbins */
+	uint64_t bytes;			/* [SYN] their size together */
+	struct report_buf *out;
+	struct cell_index *index;
+	int rv;
+};
+
+struct block_job {
+	struct hive *hive;
+	struct hbin_list *list;
+	struct block_batch *batches;
+	uint32_t batch_count;
+	uint32_t next;			/* [SYN] next batch to hand out */
+	struct report_scope *scope;	/* [SYN] see report_use_scope() */
+};
+
+static void *check_blocks_worker(void *arg)
+{
+	struct block_job *job = arg;
+	TALLOC_CTX *mem_ctx;
+
+	/* [SYN] talloc isn't thread safe within one hierarchy, so every worker
+	 * gets a tree of its own. */
+	mem_ctx = talloc_new(NULL);
+	if (!mem_ctx) {
+		return NULL;
+	}
+	report_use_scope(job->scope);
+
+	for (;;) {
+		uint32_t n = __sync_fetch_and_add(&job->next, 1);
+		struct block_batch *batch;
+		uint32_t i;
+
+		if (n >= job->batch_count) {
+			break;
+		}
+		batch = &job->batches[n];
+		batch->out = report_buf_new(mem_ctx);
+		batch->index = cell_index_init(mem_ctx, batch->bytes / 64);
+		if (!batch->out || !batch->index) {
+			batch->rv = -1;
+			continue;
+		}
+		report_set_buffer(batch->out);
+		batch->rv = 1;
+		for (i = batch->first; i < batch->first + batch->count; i++) {
+			if (cache_cells(job->hive, batch->index, i)) {
+				continue;
+			}
+			if (!read_blocks(job->hive, batch->index, &job->list->hbins[i],
+						txlog_parse_hbin(job->hive, &job->list->hbins[i]))) {
+				batch->rv = 0;
+			}
+		}
+		report_set_buffer(NULL);
+	}
+	return mem_ctx;
+}
+
+int check_blocks (TALLOC_CTX *mem_ctx, struct hive *hive, struct hbin_list *list, int jobs)
+{
+	struct block_job job;
+	pthread_t *threads;
+	TALLOC_CTX **worker_ctx;
+	uint64_t batch_bytes;
+	uint32_t i;
+	int succes = 1;
+	int started;
+
+	if (jobs <= 1 || list->count <= 1) {
+		for (i = 0; i < list->count; i++) {
+			if (cache_cells(hive, hive->index, i)) {
+				continue;
+			}
+			if (!read_blocks(hive, hive->index, &list->hbins[i],
+						txlog_parse_hbin(hive, &list->hbins[i]))) {
+				succes = 0;
+			}
+		}
+		return succes;
+	}
+
+	/* [SYN] A few batches per worker keeps them busy until the end. hbins
+	 * vary in size, so batches are made up to a number of bytes. */
+	batch_bytes = (uint64_t)hive->regf.data_size / (jobs * 8);
+	if (batch_bytes < 0x1000) {
+		batch_bytes = 0x1000;
+	} else if (batch_bytes > 64 * 0x1000) {
+		batch_bytes = 64 * 0x1000;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.hive = hive;
+	job.list = list;
+	job.scope = report_get_scope();
+	/* [SYN] Every batch but the last is full, one spare for the loop below */
+	job.batches = talloc_zero_array(mem_ctx, struct block_batch,
+			hive->regf.data_size / batch_bytes + 2);
+	threads = talloc_array(mem_ctx, pthread_t, jobs);
+	worker_ctx = talloc_zero_array(mem_ctx, TALLOC_CTX *, jobs);
+	if (!job.batches || !threads || !worker_ctx) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
+		return 0;
+	}
+	for (i = 0; i < list->count; i++) {
+		struct block_batch *batch = &job.batches[job.batch_count];
+
+		if (batch->count == 0) {
+			batch->first = i;
+		}
+		batch->count++;
+		batch->bytes += list->hbins[i].size;
+		if (batch->bytes >= batch_bytes) {
+			job.batch_count++;
+		}
+	}
+	if (job.batches[job.batch_count].count) {
+		job.batch_count++;
+	}
+
+	for (started = 0; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, check_blocks_worker, &job) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		/* [SYN] No threads at all, do it ourselves */
+		worker_ctx[0] = check_blocks_worker(&job);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], &worker_ctx[i]);
+	}
+
+	for (i = 0; i < job.batch_count; i++) {
+		struct block_batch *batch = &job.batches[i];
+
+		if (batch->rv < 0 || !batch->out) {
+			diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+					"Memory allocation error\n");
+			succes = 0;
+			continue;
+		}
+		report_flush(batch->out);
+		if (!batch->rv) {
+			succes = 0;
+		}
+		if (!cell_index_append(hive->index, batch->index)) {
+			succes = 0;
+		}
+	}
+
+	for (i = 0; i < jobs; i++) {
+		if (worker_ctx[i]) {
+			talloc_free(worker_ctx[i]);
+		}
+	}
+	talloc_free(worker_ctx);
+	talloc_free(threads);
+	talloc_free(job.batches);
+	return succes;
+}
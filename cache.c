@@ -0,0 +1,672 @@
+/*
+ * cache.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the --cache sidecar, for checking the same hive again
+ * after it changed a little. After a check without findings, it stores a
+ * hash of every hbin, the cells pass 2 found in it, and for every key the
+ * cells its check in pass 3 reached. The next check takes the cells of the
+ * hbins that are still the same from the cache, and doesn't walk the keys
+ * whose cells, and those of all keys below them, are all in such hbins.
+ * Those keys are only replayed: their cells are marked reached and their
+ * sk records counted, so pass 4 and 5 still see the whole tree.
+ *
+ * The file is in host byte order, it is not meant to be moved around:
+ *
+ *   struct cache_header
+ *   struct cache_hbin[hbin_count]	by offset
+ *   struct cell_entry[cell_count]	by offset
+ *   struct cache_key[key_count]	by offset
+ *   uint32_t edges[edge_count]		by key, then offset
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+#define CACHE_MAGIC	"chkregfC"
+#define CACHE_VERSION	1
+
+/* [SYN] Offsets are relative to 0x1000 throughout, as in the cell index */
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t data_size;		/* [SYN] from the regf header */
+	uint32_t key_offset;
+	uint32_t minor_version;
+	uint32_t hbin_count;
+	uint32_t cell_count;
+	uint32_t key_count;
+	uint32_t edge_count;
+};
+
+struct cache_hbin {
+	uint32_t offset;
+	uint32_t size;
+	uint64_t hash;
+	uint32_t first_cell;
+	uint32_t cell_count;
+};
+
+struct cache_key {
+	uint32_t offset;
+	uint32_t parent;		/* [SYN] 0 for the root key */
+	uint32_t first_edge;
+	uint32_t edge_count;
+};
+
+struct hive_cache {
+	/* [SYN] From the file, all NULL if there was none that fits */
+	uint8_t *data;
+	struct cache_header *header;
+	struct cache_hbin *hbins;
+	struct cell_entry *cells;
+	struct cache_key *keys;
+	uint32_t *edges;
+	struct cache_pair *children;	/* [SYN] parent, key index; by parent */
+	uint8_t *dirty;			/* [SYN] per key, set if it has to be walked */
+
+	/* [SYN] For the hbins of this check */
+	uint64_t *hashes;
+	int32_t *reuse;			/* [SYN] cached hbin with the same contents, or -1 */
+	uint32_t reused;
+
+	/* [SYN] What pass 3 collected, for the next file */
+	struct cache_log keys_log;
+	struct cache_log edges_log;
+	uint64_t replayed;
+};
+
+/* [SYN] Fast enough to not show next to pass 2, good enough to tell an hbin
+ * changed. hbins are a multiple of 0x1000 bytes. */
+static uint64_t cache_hash(const uint8_t *data, uint64_t len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+	uint64_t i, w;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, data + i, 8);
+		h ^= w * 0x87C37B91114253D5ULL;
+		h = ((h << 31) | (h >> 33)) * 0x4CF5AD432745937FULL;
+	}
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* [SYN] Check that the counts in the header fit the file, so nothing below
+ * reads past it */
+static int cache_parse(struct hive_cache *cache, uint64_t size)
+{
+	struct cache_header *header = (struct cache_header *)cache->data;
+	uint64_t need;
+	uint32_t i;
+
+	if (size < sizeof(*header)) {
+		return 0;
+	}
+	need = sizeof(*header) +
+		(uint64_t)header->hbin_count * sizeof(struct cache_hbin) +
+		(uint64_t)header->cell_count * sizeof(struct cell_entry) +
+		(uint64_t)header->key_count * sizeof(struct cache_key) +
+		(uint64_t)header->edge_count * sizeof(uint32_t);
+	if (need != size) {
+		return 0;
+	}
+	cache->header = header;
+	cache->hbins = (struct cache_hbin *)(header + 1);
+	cache->cells = (struct cell_entry *)(cache->hbins + header->hbin_count);
+	cache->keys = (struct cache_key *)(cache->cells + header->cell_count);
+	cache->edges = (uint32_t *)(cache->keys + header->key_count);
+
+	for (i = 0; i < header->hbin_count; i++) {
+		struct cache_hbin *hbin = &cache->hbins[i];
+
+		if ((uint64_t)hbin->first_cell + hbin->cell_count > header->cell_count ||
+				(i > 0 && hbin->offset <= cache->hbins[i-1].offset)) {
+			return 0;
+		}
+	}
+	for (i = 0; i < header->key_count; i++) {
+		struct cache_key *key = &cache->keys[i];
+
+		if ((uint64_t)key->first_edge + key->edge_count > header->edge_count ||
+				(i > 0 && key->offset <= cache->keys[i-1].offset)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int compare_pairs(const void *a, const void *b)
+{
+	const struct cache_pair *x = a, *y = b;
+
+	if (x->first != y->first) {
+		return x->first < y->first ? -1 : 1;
+	}
+	if (x->second != y->second) {
+		return x->second < y->second ? -1 : 1;
+	}
+	return 0;
+}
+
+/* [SYN] Read the cache file at path, if there is one that belongs to this
+ * hive. Returns 0 only if out of memory. */
+int cache_load(struct hive *hive, const char *path)
+{
+	struct hive_cache *cache;
+	struct cache_header *header;
+	FILE *fd;
+	long size;
+	uint32_t i;
+
+	if (!(cache = talloc_zero(hive, struct hive_cache))) {
+		return 0;
+	}
+	hive->cache = cache;
+
+	if (!(fd = fopen(path, "rb"))) {
+		return 1;
+	}
+	if (fseek(fd, 0, SEEK_END) != 0 || (size = ftell(fd)) < 0 ||
+			fseek(fd, 0, SEEK_SET) != 0) {
+		fclose(fd);
+		return 1;
+	}
+	if (!(cache->data = talloc_size(cache, size ? size : 1))) {
+		fclose(fd);
+		return 0;
+	}
+	if (fread(cache->data, 1, size, fd) != size || !cache_parse(cache, size)) {
+		report("Cache %s is unreadable, checking everything\n", path);
+		cache->header = NULL;
+	}
+	fclose(fd);
+
+	header = cache->header;
+	if (header && (memcmp(header->magic, CACHE_MAGIC, 8) != 0 ||
+			header->version != CACHE_VERSION ||
+			header->data_size != hive->regf.data_size ||
+			header->key_offset != hive->regf.key_offset ||
+			header->minor_version != hive->regf.version[1])) {
+		report("Cache %s is of another hive, checking everything\n", path);
+		header = cache->header = NULL;
+	}
+	if (!header) {
+		talloc_free(cache->data);
+		cache->data = NULL;
+		return 1;
+	}
+
+	cache->children = talloc_array(cache, struct cache_pair, header->key_count + 1);
+	cache->dirty = talloc_zero_array(cache, uint8_t, header->key_count + 1);
+	if (!cache->children || !cache->dirty) {
+		cache->header = NULL;
+		return 0;
+	}
+	for (i = 0; i < header->key_count; i++) {
+		cache->children[i].first = cache->keys[i].parent;
+		cache->children[i].second = i;
+	}
+	qsort(cache->children, header->key_count, sizeof(struct cache_pair), compare_pairs);
+	return 1;
+}
+
+/* [SYN] Index of the cached key at offset, or -1 */
+static int64_t cache_key_find(struct hive_cache *cache, uint32_t offset)
+{
+	uint32_t low = 0, high = cache->header->key_count;
+
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+
+		if (cache->keys[mid].offset < offset) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low < cache->header->key_count && cache->keys[low].offset == offset) {
+		return low;
+	}
+	return -1;
+}
+
+/* [SYN] Index of the cached hbin offset is in, or -1 */
+static int64_t cache_hbin_find(struct hive_cache *cache, uint32_t offset)
+{
+	uint32_t low = 0, high = cache->header->hbin_count;
+
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+
+		if (cache->hbins[mid].offset <= offset) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low == 0 || offset - cache->hbins[low-1].offset >= cache->hbins[low-1].size) {
+		return -1;
+	}
+	return low - 1;
+}
+
+/* [SYN] Hash the hbins and see which are the same as last time. A key has
+ * to be walked if one of its cells is in an hbin that changed, and so do
+ * the keys above it. Returns 0 if out of memory. */
+int cache_prepare(struct hive *hive, struct hbin_list *list)
+{
+	struct hive_cache *cache = hive->cache;
+	uint8_t *kept = NULL;
+	uint32_t i, j;
+
+	if (!cache) {
+		return 1;
+	}
+	cache->hashes = talloc_array(cache, uint64_t, list->count + 1);
+	cache->reuse = talloc_array(cache, int32_t, list->count + 1);
+	if (!cache->hashes || !cache->reuse) {
+		return 0;
+	}
+	if (cache->header) {
+		kept = talloc_zero_array(cache, uint8_t, cache->header->hbin_count + 1);
+		if (!kept) {
+			return 0;
+		}
+	}
+
+	for (i = 0, j = 0; i < list->count; i++) {
+		struct hbin_entry *hbin = &list->hbins[i];
+		uint8_t *view = hive_view(hive, 0x1000 + (uint64_t)hbin->offset, hbin->size);
+
+		/* [SYN] An hbin running past the end never matches */
+		cache->hashes[i] = view ? cache_hash(view, hbin->size) : 0;
+		cache->reuse[i] = -1;
+		if (!view || !cache->header) {
+			continue;
+		}
+		while (j < cache->header->hbin_count && cache->hbins[j].offset < hbin->offset) {
+			j++;
+		}
+		if (j < cache->header->hbin_count &&
+				cache->hbins[j].offset == hbin->offset &&
+				cache->hbins[j].size == hbin->size &&
+				cache->hbins[j].hash == cache->hashes[i]) {
+			cache->reuse[i] = j;
+			kept[j] = 1;
+			cache->reused++;
+		}
+	}
+	if (!cache->header) {
+		return 1;
+	}
+
+	for (i = 0; i < cache->header->key_count; i++) {
+		struct cache_key *key = &cache->keys[i];
+		int64_t k;
+
+		for (j = 0; j < key->edge_count; j++) {
+			int64_t h = cache_hbin_find(cache, cache->edges[key->first_edge + j]);
+
+			if (h < 0 || !kept[h]) {
+				break;
+			}
+		}
+		if (j == key->edge_count) {
+			continue;
+		}
+		/* [SYN] Stop at a key that is marked already, the ones above it
+		 * are marked too, or will be when it gets its turn */
+		for (k = i; k >= 0 && !cache->dirty[k]; k = cache_key_find(cache, cache->keys[k].parent)) {
+			cache->dirty[k] = 1;
+			if (cache->keys[k].parent == 0) {
+				break;
+			}
+		}
+	}
+	talloc_free(kept);
+	return 1;
+}
+
+/* [SYN] Pass 2: if the hbin is the same as last time, put the cells the
+ * cache has for it in index and return 1. */
+int cache_cells(struct hive *hive, struct cell_index *index, uint32_t hbin)
+{
+	struct hive_cache *cache = hive->cache;
+	struct cache_hbin *cached;
+	struct cell_index more;
+	uint64_t kinds[RECORD_KINDS], free_cells = 0, bytes = 0;
+	uint32_t i;
+
+	if (!cache || !cache->reuse || cache->reuse[hbin] < 0) {
+		return 0;
+	}
+	cached = &cache->hbins[cache->reuse[hbin]];
+	more.cells = &cache->cells[cached->first_cell];
+	more.count = cached->cell_count;
+	more.alloc = cached->cell_count;
+	if (!cell_index_append(index, &more)) {
+		return 0;
+	}
+
+	memset(kinds, 0, sizeof(kinds));
+	for (i = 0; i < more.count; i++) {
+		if (!more.cells[i].allocated) {
+			free_cells++;
+		} else if (more.cells[i].type < RECORD_KINDS) {
+			kinds[more.cells[i].type]++;
+		}
+		bytes += more.cells[i].size;
+	}
+	for (i = 0; i < RECORD_KINDS; i++) {
+		if (kinds[i]) {
+			__atomic_add_fetch(&hive->stats.cells[i], kinds[i], __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_add_fetch(&hive->stats.free_cells, free_cells, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hive->stats.cell_bytes, bytes, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* [SYN] Pass 3: if the key at offset, referenced from parent, and all keys
+ * below it are the same as last time, do what walking them would do apart
+ * from the checks, and return 1. */
+int cache_replay(struct hive *hive, struct tree_stack *stack, uint32_t offset,
+		uint32_t parent)
+{
+	struct hive_cache *cache = hive->cache;
+	uint32_t *todo, depth = 0, alloc = 64, done = 0;
+	int64_t k;
+
+	if (!cache || !cache->dirty) {
+		return 0;
+	}
+	k = cache_key_find(cache, offset);
+	if (k < 0 || cache->dirty[k] || cache->keys[k].parent != parent) {
+		return 0;
+	}
+	if (!(todo = malloc(alloc * sizeof(uint32_t)))) {
+		return 0;
+	}
+
+	todo[depth++] = k;
+	/* [SYN] A broken cache could loop, no tree has more keys than it */
+	while (depth > 0 && done++ < cache->header->key_count) {
+		struct cache_key *key = &cache->keys[todo[--depth]];
+		struct cache_pair *child;
+		uint32_t i, low, high;
+
+		if (stack->logging) {
+			cache_log_add(&stack->keys, key->offset, key->parent);
+		}
+		for (i = 0; i < key->edge_count; i++) {
+			uint32_t edge = cache->edges[key->first_edge + i];
+			struct hbin_data_block block;
+
+			if (!get_cell(hive, edge, key->offset, &block)) {
+				continue;
+			}
+			if (block.size >= 8 && record_kind(block.data) == RECORD_SK) {
+				sk_table_ref(hive, edge, &block);
+			}
+			if (stack->logging) {
+				cache_log_add(&stack->edges, key->offset, edge);
+			}
+		}
+
+		/* [SYN] The children are a run in the list sorted by parent */
+		low = 0;
+		high = cache->header->key_count;
+		while (low < high) {
+			uint32_t mid = low + (high - low) / 2;
+
+			if (cache->children[mid].first < key->offset) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+		child = &cache->children[low];
+		for (; child < cache->children + cache->header->key_count &&
+				child->first == key->offset; child++) {
+			if (depth == alloc) {
+				uint32_t *bigger = realloc(todo, alloc * 2 * sizeof(uint32_t));
+
+				/* [SYN] Don't replay half a subtree, let the caller
+				 * walk it */
+				if (!bigger) {
+					free(todo);
+					diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+							"Memory allocation error\n");
+					return 0;
+				}
+				todo = bigger;
+				alloc *= 2;
+			}
+			todo[depth++] = child->second;
+		}
+	}
+	free(todo);
+	__atomic_add_fetch(&cache->replayed, done, __ATOMIC_RELAXED);
+	return 1;
+}
+
+int cache_log_add(struct cache_log *log, uint32_t first, uint32_t second)
+{
+	if (log->count == log->alloc) {
+		size_t alloc = log->alloc ? log->alloc * 2 : 1024;
+		struct cache_pair *pairs;
+
+		if (log->failed) {
+			return 0;
+		}
+		pairs = realloc(log->pairs, alloc * sizeof(struct cache_pair));
+		if (!pairs) {
+			log->failed = 1;
+			return 0;
+		}
+		log->pairs = pairs;
+		log->alloc = alloc;
+	}
+	log->pairs[log->count].first = first;
+	log->pairs[log->count].second = second;
+	log->count++;
+	return 1;
+}
+
+void cache_log_free(struct cache_log *log)
+{
+	free(log->pairs);
+	memset(log, 0, sizeof(*log));
+}
+
+static void cache_log_append(struct cache_log *log, struct cache_log *more)
+{
+	size_t i;
+
+	log->failed |= more->failed;
+	for (i = 0; i < more->count && !log->failed; i++) {
+		cache_log_add(log, more->pairs[i].first, more->pairs[i].second);
+	}
+}
+
+/* [SYN] Add what a pass 3 worker collected. Called after the walk. */
+void cache_collect(struct hive *hive, struct tree_stack *stack)
+{
+	struct hive_cache *cache = hive->cache;
+
+	if (!cache || !stack->logging) {
+		return;
+	}
+	cache_log_append(&cache->keys_log, &stack->keys);
+	cache_log_append(&cache->edges_log, &stack->edges);
+}
+
+/* [SYN] Called when the hive is closed */
+void cache_close(struct hive *hive)
+{
+	struct hive_cache *cache = hive->cache;
+
+	cache_log_free(&cache->keys_log);
+	cache_log_free(&cache->edges_log);
+	talloc_free(cache);
+	hive->cache = NULL;
+}
+
+void cache_summary(struct hive *hive)
+{
+	struct hive_cache *cache = hive->cache;
+
+	if (!cache || !cache->header) {
+		return;
+	}
+	report("Cache: %lu of %lu hbins unchanged, %llu of %llu keys not walked\n",
+			(unsigned long)cache->reused,
+			(unsigned long)cache->header->hbin_count,
+			(unsigned long long)cache->replayed,
+			(unsigned long long)cache->header->key_count);
+}
+
+static int cache_write(FILE *fd, struct hive *hive, struct hbin_list *list)
+{
+	struct hive_cache *cache = hive->cache;
+	struct cell_index *index = hive->index;
+	struct cache_log *keys = &cache->keys_log, *edges = &cache->edges_log;
+	struct cache_header header;
+	size_t i, e, c;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, 8);
+	header.version = CACHE_VERSION;
+	header.data_size = hive->regf.data_size;
+	header.key_offset = hive->regf.key_offset;
+	header.minor_version = hive->regf.version[1];
+	header.hbin_count = list->count;
+	header.cell_count = index->count;
+	header.key_count = keys->count;
+	header.edge_count = edges->count;
+	if (fwrite(&header, sizeof(header), 1, fd) != 1) {
+		return 0;
+	}
+
+	for (i = 0, c = 0; i < list->count; i++) {
+		struct cache_hbin hbin;
+
+		memset(&hbin, 0, sizeof(hbin));
+		hbin.offset = list->hbins[i].offset;
+		hbin.size = list->hbins[i].size;
+		hbin.hash = cache->hashes[i];
+		while (c < index->count && index->cells[c].offset < hbin.offset) {
+			c++;
+		}
+		hbin.first_cell = c;
+		while (c < index->count && index->cells[c].offset - hbin.offset < hbin.size) {
+			c++;
+		}
+		hbin.cell_count = c - hbin.first_cell;
+		if (fwrite(&hbin, sizeof(hbin), 1, fd) != 1) {
+			return 0;
+		}
+	}
+	if (index->count &&
+			fwrite(index->cells, sizeof(struct cell_entry), index->count, fd) != index->count) {
+		return 0;
+	}
+
+	for (i = 0, e = 0; i < keys->count; i++) {
+		struct cache_key key;
+
+		key.offset = keys->pairs[i].first;
+		key.parent = keys->pairs[i].second;
+		while (e < edges->count && edges->pairs[e].first < key.offset) {
+			e++;
+		}
+		key.first_edge = e;
+		while (e < edges->count && edges->pairs[e].first == key.offset) {
+			e++;
+		}
+		key.edge_count = e - key.first_edge;
+		if (fwrite(&key, sizeof(key), 1, fd) != 1) {
+			return 0;
+		}
+	}
+	for (i = 0; i < edges->count; i++) {
+		if (fwrite(&edges->pairs[i].second, sizeof(uint32_t), 1, fd) != 1) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* [SYN] Keep only the first of pairs that are the same */
+static void cache_log_sort(struct cache_log *log)
+{
+	size_t i, n = 0;
+
+	qsort(log->pairs, log->count, sizeof(struct cache_pair), compare_pairs);
+	for (i = 0; i < log->count; i++) {
+		if (n == 0 || compare_pairs(&log->pairs[n-1], &log->pairs[i]) != 0) {
+			log->pairs[n++] = log->pairs[i];
+		}
+	}
+	log->count = n;
+}
+
+/* [SYN] Write the cache for this check. Only called if it found nothing, so
+ * everything taken from the cache next time is known to be good. The file
+ * is replaced in one go, a crash leaves the old one. */
+int cache_save(struct hive *hive, struct hbin_list *list)
+{
+	struct hive_cache *cache = hive->cache;
+	char *tmp;
+	FILE *fd;
+	size_t i;
+	int ok;
+
+	if (!cache || !cache->hashes || cache->keys_log.failed || cache->edges_log.failed) {
+		return 0;
+	}
+	cache_log_sort(&cache->keys_log);
+	cache_log_sort(&cache->edges_log);
+	/* [SYN] A key reached twice is a broken tree, nothing to cache then */
+	for (i = 1; i < cache->keys_log.count; i++) {
+		if (cache->keys_log.pairs[i].first == cache->keys_log.pairs[i-1].first) {
+			return 0;
+		}
+	}
+
+	if (!(tmp = talloc_asprintf(cache, "%s.tmp", hive->cache_path))) {
+		return 0;
+	}
+	if (!(fd = fopen(tmp, "wb"))) {
+		talloc_free(tmp);
+		return 0;
+	}
+	ok = cache_write(fd, hive, list);
+	if (fclose(fd) != 0) {
+		ok = 0;
+	}
+	if (!ok || rename(tmp, hive->cache_path) != 0) {
+		remove(tmp);
+		ok = 0;
+	}
+	talloc_free(tmp);
+	return ok;
+}
@@ -0,0 +1,186 @@
+/*
+ * cellindex.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the cell index. Pass 2 records every cell it walks
+ * over, so pass 3 can resolve offsets without going back to the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+struct cell_index *cell_index_init(TALLOC_CTX *mem_ctx, uint32_t hint)
+{
+	struct cell_index *index;
+
+	index = talloc_zero(mem_ctx, struct cell_index);
+	if (!index) {
+		return NULL;
+	}
+	if (hint < 64) {
+		hint = 64;
+	}
+	index->cells = talloc_array(index, struct cell_entry, hint);
+	if (!index->cells) {
+		talloc_free(index);
+		return NULL;
+	}
+	index->alloc = hint;
+	return index;
+}
+
+int cell_index_add(struct cell_index *index, uint32_t offset, uint32_t size,
+		uint16_t type, int allocated)
+{
+	struct cell_entry *cell;
+
+	/* [SYN] Pass 2 walks the hbins in order, so the index stays sorted.
+	 * Anything else means we've been fed the same region twice. */
+	if (index->count > 0 && index->cells[index->count-1].offset >= offset) {
+		diag(DIAG_CELL_ORDER, offset+0x1000, 0, RECORD_UNKNOWN,
+				"cell at 0x%lx recorded out of order\n",
+				(long)offset+0x1000);
+		return 0;
+	}
+	if (index->count == index->alloc) {
+		struct cell_entry *cells;
+
+		cells = talloc_realloc(index, index->cells, struct cell_entry,
+				index->alloc * 2);
+		if (!cells) {
+			diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+					"Memory allocation error\n");
+			return 0;
+		}
+		index->cells = cells;
+		index->alloc *= 2;
+	}
+	cell = &index->cells[index->count++];
+	cell->offset = offset;
+	cell->size = size;
+	cell->type = type;
+	cell->allocated = allocated;
+	return 1;
+}
+
+/* [SYN] Add the cells of a later part of the file to the index */
+int cell_index_append(struct cell_index *index, struct cell_index *more)
+{
+	uint32_t alloc = index->alloc;
+
+	if (more->count == 0) {
+		return 1;
+	}
+	if (index->count > 0 &&
+			index->cells[index->count-1].offset >= more->cells[0].offset) {
+		diag(DIAG_CELL_ORDER, more->cells[0].offset+0x1000, 0, RECORD_UNKNOWN,
+				"cell at 0x%lx recorded out of order\n",
+				(long)more->cells[0].offset+0x1000);
+		return 0;
+	}
+	while (alloc < index->count + more->count) {
+		alloc *= 2;
+	}
+	if (alloc != index->alloc) {
+		struct cell_entry *cells;
+
+		cells = talloc_realloc(index, index->cells, struct cell_entry, alloc);
+		if (!cells) {
+			diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+					"Memory allocation error\n");
+			return 0;
+		}
+		index->cells = cells;
+		index->alloc = alloc;
+	}
+	memcpy(&index->cells[index->count], more->cells,
+			more->count * sizeof(struct cell_entry));
+	index->count += more->count;
+	return 1;
+}
+
+/* [SYN] Returns the cell starting at or containing offset, NULL if no cell
+ * was recorded there. */
+struct cell_entry *cell_index_find(struct cell_index *index, uint32_t offset)
+{
+	uint32_t low = 0, high = index->count;
+
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+
+		if (index->cells[mid].offset <= offset) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	/* [SYN] low is the first cell past offset, the one before may hold it */
+	if (low == 0) {
+		return NULL;
+	}
+	if (offset - index->cells[low-1].offset >= index->cells[low-1].size) {
+		return NULL;
+	}
+	return &index->cells[low-1];
+}
+
+/* [SYN] Look up the cell at offset for pass 3, referenced from parent_off.
+ * Fills in block, which points into the hive, and returns 1 if the cell is
+ * a valid target. */
+int get_cell(struct hive *hive, hive_off_t offset, hive_off_t parent_off,
+		struct hbin_data_block *block)
+{
+	struct cell_entry *cell;
+
+	/* [SYN] 0xFFFFFFFF and the like end up here as well */
+	if (offset < 0 || offset >= hive->regf.data_size) {
+		diag(DIAG_CELL_OFFSET, offset+0x1000, parent_off, RECORD_UNKNOWN,
+				"Invalid offset 0x%lx referenced from 0x%lx\n",
+				(long)offset, (long)cell_file_off(parent_off));
+		return 0;
+	}
+
+	cell = cell_index_find(hive->index, offset);
+	if (!cell) {
+		/* [SYN] Pass 2 stopped early in this hbin at a broken cell,
+		 * so the index can't tell. Read the block itself. */
+		if (!get_hbin_data_block(hive, offset, parent_off, block)) {
+			return 0;
+		}
+		reached_mark(hive, offset);
+		return 1;
+	}
+	if (cell->offset != offset) {
+		diag(DIAG_CELL_INSIDE, offset+0x1000, parent_off, RECORD_UNKNOWN,
+				"Reference to 0x%lx from 0x%lx points into the block at 0x%lx\n",
+				(long)offset+0x1000, (long)cell_file_off(parent_off),
+				(long)cell->offset+0x1000);
+		return 0;
+	}
+	if (!cell->allocated) {
+		diag(DIAG_CELL_UNUSED, offset+0x1000, parent_off, RECORD_UNKNOWN,
+				"Referencing unused block (0x%lx) with size 0x%lx from 0x%lx\n",
+				(long)offset+0x1000, (long)cell->size, (long)cell_file_off(parent_off));
+		return 0;
+	}
+
+	block->size = cell->size;
+	block->data = hive->base + 0x1000 + offset + 4;
+	reached_mark(hive, offset);
+	return 1;
+}
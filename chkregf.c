@@ -13,12 +13,9 @@
  * This file contains the main registry checking code.
  *
  * TODO:
- * - Add pass 4, checking for orphans
  * - Maybe add a pass 5, for specific registry value data, like incorrect
  *   policy values.
  * - Big endian support and platforms with different alignment than x86
- * - Check sk reference counts
- * - Check sk pointer consistency
  * - Check security descriptors
  * 
  */
@@ -30,257 +27,482 @@
 #include <string.h>
 #include <talloc.h>
 #include <ctype.h>
+#include <unistd.h>
 #include "regf.h"
 #include "chkregf.h"
 #include "config.h"
 
+/* [SYN] Set by -t, report how long each pass took */
+int show_timings;
+/* [SYN] Set by --stats, 2 for --stats=json */
+int show_stats;
+/* [SYN] Set by --cache, the file is NULL for one next to the hive */
+int use_cache;
+const char *cache_file;
+/* [SYN] Set by --logs, and --dirty-only */
+int use_logs;
+int dirty_only;
+/* [SYN] Set by --recover */
+int use_recover;
 
-
-
-/* [SYN] regf data should be available globally */
-struct regf_block regf;
-
-struct regf_block *get_regf_struct(void)
-{
-	return &regf;
-}
-
-uint32_t get_hbin_header(FILE *fd, signed long int offset)
+uint32_t get_hbin_header(struct hive *hive, hive_off_t offset)
 {
 	struct hbin_block hbin;
+	uint8_t *view;
 
-	
-	fseek(fd, offset + 0x1000, SEEK_SET);
-
-	if (!fread(&hbin, sizeof(hbin), 1, fd)) {
-		printf("Error: short read while reading hbin block at 0x%lx\n",
+	if (!(view = hive_view(hive, offset + 0x1000, sizeof(hbin)))) {
+		diag(DIAG_HBIN_READ, offset+0x1000, 0, RECORD_UNKNOWN,
+				"short read while reading hbin block at 0x%lx\n",
 			offset + 0x1000);
 		return 0;
 	}
+	memcpy(&hbin, view, sizeof(hbin));
 
 	/* [SYN] this should be a hbin block */
 	if (hbin.id != 0x6E696268) {
-		puts("Error: this is no hbin block!");
+		diag(DIAG_HBIN_SIGNATURE, offset+0x1000, 0, RECORD_UNKNOWN,
+				"this is no hbin block!\n");
 		return 0;
 	}
 	
 	/* [SYN] The offset from first data block should be offset - 0x1000 */
 	if (hbin.offset_from_first != offset 
 			|| hbin.offset_from_first % 0x1000 != 0) {
-		printf("Error: hbin offset to first incorrect at 0x%lx\n", 
+		diag(DIAG_HBIN_OFFSET, offset+0x1000, 0, RECORD_UNKNOWN,
+				"hbin offset to first incorrect at 0x%lx\n", 
 				offset+0x1000);
 		return 0;
 	}
 	
 	/* [SYN] The offset to the next record should be a multiple of 0x1000 */
 	if (hbin.offset_to_next % 0x1000 != 0) {
-		printf("Error: hbin offset to next isn't a multiple of 0x1000 at 0x%lx\n",
+		diag(DIAG_HBIN_NEXT, offset+0x1000, 0, RECORD_UNKNOWN,
+				"hbin offset to next isn't a multiple of 0x1000 at 0x%lx\n",
 				offset+0x1000);
 		return 0;
 	}
+	/* [SYN] Pass 2 reads all of it, it has to be there */
+	if (hbin.offset_to_next == 0 ||
+			hbin.offset_to_next > hive->regf.data_size - offset) {
+		diag(DIAG_HBIN_NEXT, offset+0x1000, 0, RECORD_UNKNOWN,
+				"hbin offset to next 0x%lx runs past the end of the data at 0x%lx\n",
+				(long)hbin.offset_to_next, offset+0x1000);
+		return 0;
+	}
 	
 	/* [SYN] The size of the hbin should be identical to the relative 
 	 * offset of the next hbin. Windows XP doesn't use it. */
 	return (hbin.offset_to_next);
 }
 
-int read_regf_header(FILE *fd)
+/* [SYN] XOR of the dwords in front of the checksum */
+uint32_t regf_checksum(const struct regf_block *regf)
 {
-	short int i;
 	uint32_t hash = 0;
+	short int i;
+
+	for (i = 0; i <  (0x1FC/4); i+=1) {
+		uint32_t *dword;
+		dword = (uint32_t *) regf + i;
+		hash = hash ^ *dword;
+	}
+	return hash;
+}
+
+int read_regf_header(struct hive *hive)
+{
+	struct regf_block *regf = &hive->regf;
+	short int i;
+	uint32_t hash;
+	uint8_t *view;
 	
-	fseek(fd, 0, SEEK_SET);
-	
-	if (!fread(&regf, sizeof(regf), 1, fd)) {
-		puts("Error: short read while reading regf block");
+	if (!(view = hive_view(hive, 0, sizeof(*regf)))) {
+		diag(DIAG_REGF_READ, 0, 0, RECORD_UNKNOWN,
+				"short read while reading regf block\n");
 		return 0;
 	}
+	memcpy(regf, view, sizeof(*regf));
 	
 	/* [SYN] this should be a regf file */
-	if (regf.id != 0x66676572) { /* [SYN] 'regf' */
-		puts("No 'regf' found at 0x0 (is this an NT registry file?)");
+	if (regf->id != 0x66676572) { /* [SYN] 'regf' */
+		diag(DIAG_REGF_SIGNATURE, 0, 0, RECORD_UNKNOWN,
+				"No 'regf' found at 0x0 (is this an NT registry file?)\n");
 		return 0;
 	}
 	/* [SYN] uk1[0] should be the same as uk1[1] */
-	if (regf.uk1[0] != regf.uk1[1]) {
-		puts("Values at 0x0004 and 0x0008 should be identical.");
+	if (regf->uk1[0] != regf->uk1[1]) {
+		diag(DIAG_REGF_SEQUENCE, 0, 0, RECORD_UNKNOWN,
+				"Values at 0x0004 and 0x0008 should be identical.\n");
 		return 0;
 	}
 	/* [SYN] 0x1, 0x3(or 0x5), 0x0, 0x1 for D-words from 0x0014 (version)*/
-	if (regf.version[0] != 0x1 || 
-			(regf.version[1] != 0x3 && regf.version[1] != 0x5) ||
-			regf.version[2] != 0x0 || regf.version[3] != 0x1) {
-		puts("D-words from 0x0014 to 0x0020 should be 0x1, 0x3 or 0x5, 0x0, 0x1");
+	if (regf->version[0] != 0x1 || 
+			(regf->version[1] != 0x3 && regf->version[1] != 0x5) ||
+			regf->version[2] != 0x0 || regf->version[3] != 0x1) {
+		diag(DIAG_REGF_VERSION, 0, 0, RECORD_UNKNOWN,
+				"D-words from 0x0014 to 0x0020 should be 0x1, 0x3 or 0x5, 0x0, 0x1\n");
 		return 0;
 	}
 	/* [SYN] Check first record key offset, usually 0x20 */
-	if (regf.key_offset < 0x20) {
-		puts("Error: 1st record key offset smaller than hbin header.");
+	if (regf->key_offset < 0x20) {
+		diag(DIAG_REGF_KEY_OFFSET, 0, 0, RECORD_UNKNOWN,
+				"1st record key offset smaller than hbin header.\n");
 		return 0;
 	}
-	if (regf.key_offset > 0x100) {
-		puts("Warning: 1st record offset seems large.");
+	if (regf->key_offset > 0x100) {
+		diag(DIAG_REGF_KEY_OFFSET_LARGE, 0, 0, RECORD_UNKNOWN,
+				"1st record offset seems large.\n");
 	}
 	
 	/* [SYN] hbin data source should be a multiple of 0x1000 */
-	if ((regf.data_size % 0x1000) != 0) {
-		puts("Error: data size should be a multiple of 0x1000");
+	if ((regf->data_size % 0x1000) != 0) {
+		diag(DIAG_REGF_DATA_SIZE, 0, 0, RECORD_UNKNOWN,
+				"data size should be a multiple of 0x1000\n");
 		return 0;
 	}
+	/* [SYN] Windows uses the top bit of a cell offset for volatile cells,
+	 * it can't get to cells past 2 GB. We check them all the same. */
+	if (regf->data_size > 0x80000000) {
+		diag(DIAG_REGF_DATA_SIZE_LARGE, 0, 0, RECORD_UNKNOWN,
+				"data size over 2 GB, Windows can't address the cells past that\n");
+	}
 	
 	/* [SYN] Check if unicode regf description is really unicode */
-	for (i = 0; i < sizeof(regf.description); i++) {
+	for (i = 0; i < sizeof(regf->description); i++) {
 		if ((i % 2) == 1) {
-			if (regf.description[i] > 0x2 &&
-					regf.description[i] != 0xFF) {
-				puts("Warning: regf description does not appear to be unicode");
+			if (regf->description[i] > 0x2 &&
+					regf->description[i] != 0xFF) {
+				diag(DIAG_REGF_DESCRIPTION, 0, 0, RECORD_UNKNOWN,
+						"regf description does not appear to be unicode\n");
 				break;
 			}
 		} 
 	}
 	
 	/* [SYN] Check the checksum */
-	for (i = 0; i <  (0x1FC/4); i+=1) {
-		uint32_t *dword;
-		dword = (uint32_t *) &regf + i;
-		hash = hash ^ *dword;
-	}
-	if (hash != regf.checksum) {
-		printf("Error: checksum incorrect; got 0x%lx, must be 0x%lx\n",
-				(long)regf.checksum, (long)hash);
-		printf("Note: This could be caused by other malicious data in the header!\n");
+	hash = regf_checksum(regf);
+	if (hash != regf->checksum) {
+		diag(DIAG_REGF_CHECKSUM, 0, 0, RECORD_UNKNOWN,
+				"checksum incorrect; got 0x%lx, must be 0x%lx\n",
+				(long)regf->checksum, (long)hash);
+		report("Note: This could be caused by other malicious data in the header!\n");
 		return 0;
 	}
 	return 1;
 }
 
-struct hbin_data_block *get_hbin_data_block(TALLOC_CTX *mem_ctx, FILE *fd, long int offset, long int parent_off)
+/* [SYN] Fills in block, which points into the hive. Unused blocks come back
+ * with a negative size, unless they are referenced from parent_off. */
+int get_hbin_data_block(struct hive *hive, hive_off_t offset, hive_off_t parent_off,
+		struct hbin_data_block *block)
 {
-	struct hbin_data_block *block;
-	long int cur_offset;
-
-	block = talloc_zero(mem_ctx, struct hbin_data_block);
+	hive_off_t cur_offset;
+	uint8_t *view;
 
 	/* [SYN] Set index to data block */
-	cur_offset = offset+0x1000;
-
-	/* [SYN] Seek to data block */
-	fseek(fd, cur_offset, SEEK_SET);
+	cur_offset = hive_off_add(offset, 0x1000);
 
 #if DODEBUG > 2
-	printf("Debug: Parsing block at cur_offset 0x%lx, parent 0x%lx\n", (long)cur_offset, (long) parent_off+0x1000);
+	report("Debug: Parsing block at cur_offset 0x%lx, parent 0x%lx\n", (long)cur_offset, (long)cell_file_off(parent_off));
 #endif
-	if (!fread(block, 4, 1, fd)) {
-		printf("Error: short read while reading hbin data record size at 0x%lx\n",
+	if (offset < 0 || !(view = hive_view(hive, cur_offset, 4))) {
+		diag(DIAG_CELL_READ, cur_offset, parent_off, RECORD_UNKNOWN,
+				"short read while reading hbin data record size at 0x%lx\n",
 				(long)cur_offset);
-		return NULL;
+		return 0;
 	}
+	memcpy(&block->size, view, 4);
 	if (block->size > 0) {
 		if (parent_off > 0) {
 			/* [SYN] Positive block->size means unused. Time to barf. */
-			printf("Error: Referencing unused block (0x%lx) with size 0x%lx from 0x%lx\n",
-					(long)cur_offset, (long)block->size, (long)parent_off);
-			return NULL;
+			diag(DIAG_CELL_UNUSED, cur_offset, parent_off, RECORD_UNKNOWN,
+					"Referencing unused block (0x%lx) with size 0x%lx from 0x%lx\n",
+					(long)cur_offset, (long)block->size, (long)cell_file_off(parent_off));
+			return 0;
 		} else {
 			block->size = -block->size;
-			return block;
+			block->data = NULL;
+			return 1;
 		}
 	}
 	if (block->size == 0) {
-		printf("Error: hbin data record size is NULL at 0x%lx\n",
+		diag(DIAG_CELL_SIZE_ZERO, cur_offset, 0, RECORD_UNKNOWN,
+				"hbin data record size is NULL at 0x%lx\n",
 				(long)cur_offset);
-		return NULL;
+		return 0;
 	}
 		
 	block->size = -block->size;
 	
-	/* [SYN] Check block->size, do not allocate it if bigger */
-	if (block->size > 32768) {
-		printf("Warning: hbin data record size (0x%lx) is quite large at 0x%lx\n",
-				(long)block->size, (long)cur_offset);
-		printf("Warning: NOT ALLOCATING THIS BLOCK.");
-		return NULL;
+	/* [SYN] The record is used in place, it has to fit in the file */
+	if (block->size < 4 || !(view = hive_view(hive, cur_offset, block->size))) {
+		diag(DIAG_CELL_READ, cur_offset, parent_off, RECORD_UNKNOWN,
+				"Failed to read hbin data record at 0x%lx\n",
+				(long)cur_offset);
+		return 0;
 	}
-		
-	/* [SYN] Allocate memory and read the record into memory */
-	if ((block->data = talloc_array(block, uint8_t, block->size)) == NULL) {
-		printf("Failed to allocate %ld bytes at record 0x%lx\n",
-				(long)block->size, (long)cur_offset);
+	block->data = view + 4;
+	return 1;
+
+}
+
+/* [SYN] Walk the hbin headers and collect the hbins in file order. On a
+ * broken header, the list stops there and bad_offset is set to its offset. */
+struct hbin_list *read_hbin_list(TALLOC_CTX *mem_ctx, struct hive *hive, hive_off_t *bad_offset)
+{
+	struct hbin_list *list;
+	hive_off_t offset;
+	uint32_t size;
+
+	*bad_offset = -1;
+
+	list = talloc_zero(mem_ctx, struct hbin_list);
+	if (!list) {
 		return NULL;
 	}
-	if (!fread(block->data, block->size, 1, fd)) {
-		printf("Error: Failed to read hbin data record at 0x%lx\n",
-				(long)cur_offset);
+	list->hbins = talloc_array(list, struct hbin_entry, hive->regf.data_size / 0x1000 + 1);
+	if (!list->hbins) {
+		talloc_free(list);
 		return NULL;
 	}
-	return block;
 
+	/* [SYN] The size is a non-zero multiple of 0x1000, or the header is bad */
+	for (offset = 0; offset >= 0 && offset < hive->regf.data_size;
+			offset = hive_off_add(offset, size)) {
+		if (!(size = get_hbin_header(hive, offset))) {
+			if (*bad_offset < 0) {
+				*bad_offset = offset;
+			}
+			if (!hive->recover) {
+				break;
+			}
+			recover_hbin(hive, offset, &list->hbins[list->count]);
+			size = list->hbins[list->count].size;
+			list->count++;
+			continue;
+		}
+		list->hbins[list->count].offset = offset;
+		list->hbins[list->count].size = size;
+		list->hbins[list->count].recovered = 0;
+		list->count++;
+	}
+	return list;
 }
 
-int main (int argc, char **argv)
+/* [SYN] Run all passes over an open hive. Everything is allocated below
+ * mem_ctx; the caller closes the hive and frees it. Returns CHECK_OK,
+ * CHECK_ERRORS or CHECK_NOMEM. If cells is set, it gets the number of cells
+ * pass 2 found. */
+int check_open_hive(TALLOC_CTX *mem_ctx, struct hive *hive, int jobs, uint32_t *cells)
 {
-	FILE *fd;
-	uint16_t i;
+	struct hbin_list *hbins;
+	struct report_buf *hbin_errors, *saved;
+	hive_off_t bad_hbin;
+	uint64_t findings = report_findings();
 	int rv;
 	int error = 0;
-	TALLOC_CTX *mem_ctx;
-	
-	if (argc == 1) {
-		puts("Usage: chkregf REGFILE");
-		return 1;
-	}
-	if (!(fd = fopen(argv[1], "r"))) {
-		puts("Error: file not found");
-		return 2;
+
+	if (cells) {
+		*cells = 0;
 	}
 
-	mem_ctx = talloc_init("chkregf registry checker");
-	if (!mem_ctx) {
-		printf("Memory allocation error\n");
-		return 3;
+	report("\nPass 1: Checking registry regf header\n\n");
+
+	stats_start(hive);
+	if (hive->log_path && !txlog_apply(hive, hive->log_path)) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
+		return CHECK_NOMEM;
 	}
-	
-	printf("\nPass 1: Checking registry regf header\n\n");
-	
-	if (!read_regf_header(fd)) {
-		printf("Regf header contains errors\n");
-		return 1;
+	if (!read_regf_header(hive)) {
+		report("Regf header contains errors\n");
+		return CHECK_ERRORS;
 	} 
-	
 
-	printf("\nPass 2: Checking keys for incorrect values\n\n");
+	hive->index = cell_index_init(hive, hive->regf.data_size / 64);
+	if (!hive->index) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
+		return CHECK_NOMEM;
+	}
+	if (hive->cache_path && !cache_load(hive, hive->cache_path)) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error, not using the cache\n");
+	}
+	stats_lap(hive, 1);
+
+	report("\nPass 2: Checking keys for incorrect values\n\n");
 	
-	for(i = 0; i < regf.data_size / 0x1000; i++) {
-		uint32_t size;
-		
-		if (!(size = get_hbin_header(fd, 0x1000 * i))) {
-			printf("Errors in hbin header at 0x%lx.",
-					(long int) (0x1000 * i) + 0x1000);
-			return 1;
-		}
-		rv = read_blocks(mem_ctx, fd, 0x1000 * i);
-		if (!rv) {
-			error = 1;
-		}
-		if (size / 0x1000 > 1) {
-			i += (size/0x1000) - 1;
+	/* [SYN] Collect the hbins first. Header errors are held back until the
+	 * hbins in front of it are checked, so the output stays in file order. */
+	hbin_errors = report_buf_new(mem_ctx);
+	saved = report_set_buffer(hbin_errors);
+	hbins = read_hbin_list(mem_ctx, hive, &bad_hbin);
+	report_set_buffer(saved);
+	if (!hbins || !hbin_errors) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
+		return CHECK_NOMEM;
+	}
+
+	if (!cache_prepare(hive, hbins)) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error, not using the cache\n");
+		cache_close(hive);
+	}
+	if (hive->dirty_only) {
+		txlog_summary(hive, hbins);
+	}
+	rv = check_blocks(mem_ctx, hive, hbins, jobs);
+	if (!rv) {
+		error = 1;
+	}
+	report_flush(hbin_errors);
+	stats_lap(hive, 2);
+	if (cells) {
+		*cells = hive->index->count;
+	}
+	if (bad_hbin >= 0) {
+		diag(DIAG_HBIN_HEADER, bad_hbin + 0x1000, 0, RECORD_UNKNOWN,
+				"Errors in hbin header at 0x%lx.",
+				bad_hbin + 0x1000);
+		if (!hive->recover) {
+			return CHECK_ERRORS;
 		}
+		report("\n");
+		error = 1;
+	}
+	if (hive->recover && (bad_hbin >= 0 || hive->recovered_cells)) {
+		recover_summary(hive, hbins);
 	}
 
-	printf("\nPass 3: Checking offsets and tree\n");
+	report("\nPass 3: Checking offsets and tree\n");
 
-	rv = parse_tree(mem_ctx, fd, regf.key_offset, 0, "nk", 0);
+	if (!reached_init(hive)) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error, not checking for orphans\n");
+	}
+	if (!sk_table_init(hive)) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error, not checking sk records\n");
+	}
+	rv = check_tree(mem_ctx, hive, jobs);
 	if (!rv) {
 		error = 1;
 	}
+	stats_lap(hive, 3);
+
+	if (hive->cache) {
+		cache_summary(hive);
+		/* [SYN] Only what is known to be good goes in the cache */
+		if (!error && report_findings() == findings &&
+				!cache_save(hive, hbins)) {
+			report("Could not write cache %s\n", hive->cache_path);
+		}
+	}
+
+	if (hive->reached) {
+		report("\nPass 4: Checking for unreferenced cells\n\n");
+		if (!check_orphans(hive)) {
+			error = 1;
+		}
+	}
+	stats_lap(hive, 4);
+
+	if (hive->sk_table) {
+		report("\nPass 5: Checking security keys\n\n");
+		if (!check_sk(hive)) {
+			error = 1;
+		}
+	}
+	stats_lap(hive, 5);
+#if DODEBUG > 2
+	report("Debug: %llu allocations served from arenas\n",
+			(unsigned long long)hive->arena_allocs);
+	report("Debug: %llu keys checked, %llu nk cells fetched\n",
+			(unsigned long long)hive->nk_visits,
+			(unsigned long long)hive->nk_fetches);
+#endif
+	if (show_timings) {
+		/* [SYN] One line, for bench.sh to pick up */
+		report("Timing: %llu bytes, %lu cells, pass 1 %.6f s, pass 2 %.6f s, pass 3 %.6f s\n",
+				(unsigned long long)hive->regf.data_size + 0x1000,
+				(unsigned long)hive->index->count,
+				hive->stats.wall[0], hive->stats.wall[1],
+				hive->stats.wall[2]);
+	}
+	if (show_stats && report_get_format() != REPORT_FINDINGS) {
+		stats_report(hive, show_stats == 2 ||
+				report_get_format() == REPORT_JSON);
+	}
 
 	if (error) {
-		printf("Errors encountered\n");
-		return 1;
+		report("Errors encountered\n");
+		return CHECK_ERRORS;
 	}
-	printf("\nDone checking, no errors...\n\n");
+	report("\nDone checking, no errors...\n\n");
+	return CHECK_OK;
+}
 
-	fclose(fd);
-	return 0;
+/* [SYN] Check one hive file, with jobs threads for pass 2 and 3. Returns
+ * CHECK_OK, CHECK_ERRORS, CHECK_NOFILE or CHECK_NOMEM. If cells is set, it
+ * gets the number of cells pass 2 found. */
+int check_hive(TALLOC_CTX *parent_ctx, const char *filename, int jobs, uint32_t *cells)
+{
+	struct report_scope *saved;
+	struct report_scope *scope;
+	struct hive *hive;
+	TALLOC_CTX *mem_ctx;
+	int rv;
+
+	if (cells) {
+		*cells = 0;
+	}
+
+	mem_ctx = talloc_new(parent_ctx);
+	/* [SYN] Findings carry the file name, for batch mode and JSON output */
+	scope = mem_ctx ? report_scope_new(mem_ctx, filename, report_get_format()) : NULL;
+	if (!scope) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
+		talloc_free(mem_ctx);
+		return CHECK_NOMEM;
+	}
+	saved = report_use_scope(scope);
+
+	if (!(hive = hive_open(mem_ctx, filename))) {
+		diag(DIAG_OPEN, 0, 0, RECORD_UNKNOWN,
+				"cannot open %s: %s\n", filename, strerror(errno));
+		rv = CHECK_NOFILE;
+	} else {
+		if (use_cache) {
+			hive->cache_path = cache_file ? cache_file :
+				talloc_asprintf(mem_ctx, "%s.chkcache", filename);
+		}
+		if (use_logs) {
+			hive->log_path = filename;
+			hive->dirty_only = dirty_only;
+		}
+		hive->recover = use_recover;
+		rv = check_open_hive(mem_ctx, hive, jobs, cells);
+		hive_close(hive);
+	}
+
+	report_use_scope(saved);
+	talloc_free(mem_ctx);
+	return rv;
 }
 
+const char *check_status_name(int status)
+{
+	switch (status) {
+		case CHECK_OK:
+			return "ok";
+		case CHECK_ERRORS:
+			return "errors";
+		case CHECK_NOFILE:
+			return "cannot open";
+		default:
+			return "out of memory";
+	}
+}
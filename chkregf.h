@@ -1,26 +1,415 @@
 #ifndef _CHKREGF_H_
 #define _CHKREGF_H_
 
-struct regf_block *get_regf_struct(void);
-
-int parse_sk (uint8_t *data, int size, long int offset);
-int parse_vk (uint8_t *data, int size, uint32_t offset);
-int parse_ri (uint8_t *_ri_ptr, int size, long int offset);
-int parse_li (uint8_t *_li_ptr, int size, long int offset);
-int parse_lh (uint8_t *_lh_ptr, int size, long int offset);
-int parse_lf (uint8_t *_lf_ptr, int size, long int offset);
-int parse_nk (TALLOC_CTX *mem_ctx, uint8_t *data, int size, long int offset);
-int read_blocks (TALLOC_CTX *parent_ctx, FILE *fd, int32_t offset);
-uint32_t get_hbin_header(FILE *fd, signed long int offset);
-struct hbin_data_block *get_hbin_data_block(TALLOC_CTX *mem_ctx, FILE *fd, long int offset, long int parent_off);
-int read_regf_header(FILE *fd);
+#include "libchkregf.h"
+
+/* [SYN] An offset in the hive file. Records refer to cells by 32 bit
+ * offsets from 0x1000, read as unsigned, so a hive can be up to 4 GB plus
+ * the header; anything computed from them is done in 64 bits. Negative
+ * means there is no such offset. */
+typedef int64_t hive_off_t;
+
+/* [SYN] offset + len, or -1 if that doesn't fit, which no view accepts */
+static inline hive_off_t hive_off_add(hive_off_t offset, int64_t len)
+{
+	hive_off_t sum;
+
+	if (offset < 0 || __builtin_add_overflow(offset, len, &sum) || sum < 0) {
+		return -1;
+	}
+	return sum;
+}
+
+/* [SYN] File offset of the cell at offset, as cells refer to each other
+ * from the start of the hbins. 0 stays 0, for "none". */
+static inline hive_off_t cell_file_off(hive_off_t offset)
+{
+	return offset ? offset + 0x1000 : 0;
+}
+
+/* [SYN] What a cell holds, going by its 2 byte signature. Value lists,
+ * value data and class names have no signature, they're unknown. */
+enum record_kind {
+	RECORD_UNKNOWN,
+	RECORD_NK,
+	RECORD_SK,
+	RECORD_VK,
+	RECORD_LF,
+	RECORD_LH,
+	RECORD_LI,
+	RECORD_RI,
+	RECORD_DB,
+	RECORD_KINDS
+};
+
+/* [SYN] Findings, for the diagnostics sink. The name, severity and the
+ * prefix of the human readable line are in the table in report.c. */
+enum diag_code {
+	DIAG_NOMEM,
+	DIAG_OPEN,
+	DIAG_THREADS,
+	DIAG_REGF_READ,
+	DIAG_REGF_SIGNATURE,
+	DIAG_REGF_SEQUENCE,
+	DIAG_REGF_VERSION,
+	DIAG_REGF_KEY_OFFSET,
+	DIAG_REGF_KEY_OFFSET_LARGE,
+	DIAG_REGF_DATA_SIZE,
+	DIAG_REGF_DATA_SIZE_LARGE,
+	DIAG_REGF_DESCRIPTION,
+	DIAG_REGF_CHECKSUM,
+	DIAG_LOG_READ,
+	DIAG_LOG_HEADER,
+	DIAG_LOG_ENTRY,
+	DIAG_HBIN_READ,
+	DIAG_HBIN_SIGNATURE,
+	DIAG_HBIN_OFFSET,
+	DIAG_HBIN_NEXT,
+	DIAG_HBIN_HEADER,
+	DIAG_CELL_READ,
+	DIAG_CELL_SIZE_ZERO,
+	DIAG_CELL_ORDER,
+	DIAG_CELL_OFFSET,
+	DIAG_CELL_INSIDE,
+	DIAG_CELL_UNUSED,
+	DIAG_CELL_UNEXPECTED,
+	DIAG_CELL_UNKNOWN,
+	DIAG_CELL_TOO_SMALL,
+	DIAG_CELL_HBIN_END,
+	DIAG_SK_SELF,
+	DIAG_SK_LINK,
+	DIAG_SK_SIZE,
+	DIAG_SK_DROPPED,
+	DIAG_SK_NEXT,
+	DIAG_SK_PREV,
+	DIAG_SK_LOOP,
+	DIAG_SK_UNLINKED,
+	DIAG_SK_USAGE,
+	DIAG_VK_NAME_LENGTH,
+	DIAG_VK_DATA_OFFSET,
+	DIAG_VK_REG_NONE,
+	DIAG_VK_TYPE,
+	DIAG_VK_FLAG,
+	DIAG_LIST_SIZE,
+	DIAG_LIST_EMPTY,
+	DIAG_LIST_OFFSET,
+	DIAG_LIST_COUNT,
+	DIAG_LIST_SORT,
+	DIAG_LF_HINT,
+	DIAG_LH_HASH,
+	DIAG_LH_VERSION,
+	DIAG_NK_NAME_LENGTH,
+	DIAG_NK_TYPE,
+	DIAG_NK_ROOT,
+	DIAG_NK_NO_PARENT,
+	DIAG_NK_PARENT,
+	DIAG_NK_SUBKEY_LIST,
+	DIAG_NK_ZERO_OFFSET,
+	DIAG_NK_CLASS_NAME,
+	DIAG_NK_VALUE_LIST,
+	DIAG_NK_NO_SK,
+	DIAG_NK_UNKNOWN,
+	DIAG_DB_SEGMENTS,
+	DIAG_DB_LIST_OFFSET,
+	DIAG_DB_COUNT,
+	DIAG_ORPHAN,
+	DIAG_ORPHAN_TOTAL,
+	DIAG_CODES
+};
+
+enum diag_severity {
+	DIAG_DEBUG,
+	DIAG_WARNING,
+	DIAG_ERROR
+};
+
+/* [SYN] How findings are written */
+enum report_format {
+	REPORT_HUMAN,
+	REPORT_JSON,		/* [SYN] JSON Lines, one object per finding */
+	REPORT_FINDINGS		/* [SYN] struct chkregf_finding, for libchkregf.c */
+};
+
+/* [SYN] Who the findings of a thread belong to, and how they're written */
+struct report_scope {
+	enum report_format format;
+	char *file;			/* [SYN] JSON escaped and quoted, or NULL */
+	uint64_t findings;		/* [SYN] diag() calls so far */
+};
+
+/* [SYN] One cell as seen by pass 2 */
+struct cell_entry {
+	uint32_t offset;		/* [SYN] offset relative to 0x1000 */
+	uint32_t size;			/* [SYN] cell size, including header */
+	uint16_t type;			/* [SYN] enum record_kind */
+	uint16_t allocated;		/* [SYN] 1 if in use */
+};
+
+/* [SYN] All cells found in pass 2, sorted by offset */
+struct cell_index {
+	struct cell_entry *cells;
+	uint32_t count;
+	uint32_t alloc;
+};
+
+/* [SYN] hbins in file order, as found by walking the hbin headers */
+struct hbin_entry {
+	uint32_t offset;		/* [SYN] offset relative to 0x1000 */
+	uint32_t size;			/* [SYN] offset to the next hbin */
+	uint32_t recovered;		/* [SYN] broken header, see recover.c */
+};
+struct hbin_list {
+	struct hbin_entry *hbins;
+	uint32_t count;
+};
+
+/* [SYN] Bump allocator, memory is given back when the arena is freed */
+struct arena_chunk;
+struct arena {
+	struct arena_chunk *chunks;	/* [SYN] newest first */
+	size_t chunk_size;
+	uint64_t allocs;		/* [SYN] allocations served, not done by talloc */
+};
+
+/* [SYN] Collected report output of a worker thread */
+struct report_buf {
+	char *data;
+	size_t len;
+	size_t alloc;
+	struct arena *arena;		/* [SYN] grow from here instead of talloc */
+	struct chkregf_finding *findings;	/* [SYN] REPORT_FINDINGS output */
+	uint32_t count;
+	uint32_t findings_alloc;
+	int lost;			/* [SYN] output dropped for lack of memory */
+};
+
+/* [SYN] What pass 3 expects to find at an offset */
+enum tree_expect {
+	EXPECT_NK,
+	EXPECT_SK,
+	EXPECT_SUBKEYLIST,
+	EXPECT_VALUELIST,
+	EXPECT_VK,
+	EXPECT_VALUE,
+	EXPECT_DB,
+	EXPECT_SEGMENTLIST,
+	EXPECT_KINDS
+};
+
+/* [SYN] Pairs of offsets pass 3 collects for the cache */
+struct cache_pair {
+	uint32_t first;
+	uint32_t second;
+};
+struct cache_log {
+	struct cache_pair *pairs;
+	size_t count;
+	size_t alloc;
+	int failed;			/* [SYN] out of memory, the log is incomplete */
+};
+
+/* [SYN] Work stack of the pass 3 tree walk */
+struct tree_frame;
+struct tree_stack {
+	struct tree_frame *frames;
+	size_t depth;
+	size_t alloc;
+	uint32_t owner;			/* [SYN] key the frame being visited belongs to */
+	uint64_t nk_fetches;		/* [SYN] nk cells looked up */
+	uint64_t nk_visits;		/* [SYN] keys checked */
+	uint64_t visits[RECORD_KINDS];	/* [SYN] cells visited, by kind */
+	uint64_t bytes;			/* [SYN] size of those cells */
+	int logging;			/* [SYN] fill in keys and edges, for --cache */
+	struct cache_log keys;		/* [SYN] key, parent key */
+	struct cache_log edges;		/* [SYN] key, cell its check reached */
+};
+
+/* [SYN] Counters for --stats. The hot ones are kept per call or per worker
+ * and added in once, so they are always on. */
+#define STAT_PASSES 5
+struct hive_stats {
+	double wall[STAT_PASSES];	/* [SYN] seconds per pass */
+	double cpu[STAT_PASSES];
+	double wall_mark;		/* [SYN] end of the previous pass */
+	double cpu_mark;
+	uint64_t cells[RECORD_KINDS];	/* [SYN] pass 2, used cells by kind */
+	uint64_t free_cells;
+	uint64_t cell_bytes;		/* [SYN] pass 2, bytes walked */
+	uint64_t visits[RECORD_KINDS];	/* [SYN] pass 3, cells visited by kind */
+	uint64_t visit_bytes;
+	uint64_t reads;			/* [SYN] read calls, for streamed hives */
+	uint64_t read_bytes;
+};
+
+/* [SYN] A memory mapped hive file, and everything known about it. All
+ * state of a check lives here, so hives can be checked side by side. */
+struct hive_stream;
+struct sk_table;
+struct hive {
+	uint8_t *base;			/* [SYN] start of the mapping */
+	uint64_t size;			/* [SYN] size of the mapping */
+	struct hive_stream *stream;	/* [SYN] set if read from a pipe */
+	struct regf_block regf;		/* [SYN] copy of the regf header */
+	struct cell_index *index;	/* [SYN] built by pass 2 */
+	uint64_t arena_allocs;		/* [SYN] talloc calls saved by arenas */
+	uint64_t *reached;		/* [SYN] cells pass 3 got to, bit per 8 bytes */
+	uint64_t reached_bits;
+	struct sk_table *sk_table;	/* [SYN] sk records and their references */
+	uint64_t nk_fetches;		/* [SYN] pass 3 nk lookups */
+	uint64_t nk_visits;		/* [SYN] pass 3 keys checked */
+	struct hive_stats stats;
+	int borrowed;			/* [SYN] base belongs to the caller */
+	const char *cache_path;		/* [SYN] --cache file, NULL if not used */
+	struct hive_cache *cache;
+	const char *log_path;		/* [SYN] --logs, the hive file they belong to */
+	uint64_t *dirty;		/* [SYN] pages the logs changed, bit per 0x1000 */
+	uint64_t dirty_bits;
+	uint64_t dirty_pages;
+	int dirty_only;			/* [SYN] pass 2 parses only hbins in dirty */
+	int recover;			/* [SYN] --recover, carry on past broken hbins */
+	uint64_t recovered_cells;	/* [SYN] cells found by searching */
+};
+
+struct hive *hive_open(TALLOC_CTX *mem_ctx, const char *filename);
+struct hive *hive_open_buffer(TALLOC_CTX *mem_ctx, const void *buf, uint64_t len);
+struct hive *hive_open_read(TALLOC_CTX *mem_ctx, chkregf_read_fn fn, void *private_data);
+void hive_close(struct hive *hive);
+uint8_t *hive_view(struct hive *hive, uint64_t offset, uint64_t len);
+int hive_overlay(struct hive *hive, uint64_t size);
+
+int txlog_apply(struct hive *hive, const char *path);
+int txlog_parse_hbin(struct hive *hive, struct hbin_entry *hbin);
+void txlog_summary(struct hive *hive, struct hbin_list *list);
+
+/* [SYN] Windows' upper case of a UTF-16 character, see upcase.txt */
+extern const uint8_t upcase_page[256];
+extern const uint16_t upcase_delta[][256];
+static inline uint16_t upcase(uint16_t c)
+{
+	return c + upcase_delta[upcase_page[c >> 8]][c & 0xFF];
+}
+
+hive_off_t recover_next_cell(struct hive *hive, hive_off_t offset, hive_off_t end);
+void recover_hbin(struct hive *hive, hive_off_t offset, struct hbin_entry *hbin);
+void recover_summary(struct hive *hive, struct hbin_list *list);
+
+void stats_start(struct hive *hive);
+void stats_lap(struct hive *hive, int pass);
+void stats_report(struct hive *hive, int json);
+
+struct hive_cache;
+int cache_load(struct hive *hive, const char *path);
+int cache_prepare(struct hive *hive, struct hbin_list *list);
+int cache_cells(struct hive *hive, struct cell_index *index, uint32_t hbin);
+int cache_replay(struct hive *hive, struct tree_stack *stack, uint32_t offset,
+		uint32_t parent);
+int cache_log_add(struct cache_log *log, uint32_t first, uint32_t second);
+void cache_log_free(struct cache_log *log);
+void cache_collect(struct hive *hive, struct tree_stack *stack);
+void cache_close(struct hive *hive);
+void cache_summary(struct hive *hive);
+int cache_save(struct hive *hive, struct hbin_list *list);
+
+struct cell_index *cell_index_init(TALLOC_CTX *mem_ctx, uint32_t hint);
+int cell_index_add(struct cell_index *index, uint32_t offset, uint32_t size,
+		uint16_t type, int allocated);
+struct cell_entry *cell_index_find(struct cell_index *index, uint32_t offset);
+int get_cell(struct hive *hive, hive_off_t offset, hive_off_t parent_off,
+		struct hbin_data_block *block);
+
+int reached_init(struct hive *hive);
+void reached_mark(struct hive *hive, uint32_t offset);
+int check_orphans(struct hive *hive);
+
+int sk_table_init(struct hive *hive);
+void sk_table_ref(struct hive *hive, uint32_t offset, struct hbin_data_block *block);
+int check_sk(struct hive *hive);
+
+struct arena *arena_new(TALLOC_CTX *mem_ctx, size_t chunk_size);
+void *arena_alloc(struct arena *arena, size_t size);
+
+struct report_buf *report_buf_new(TALLOC_CTX *mem_ctx);
+struct report_buf *report_buf_arena(struct arena *arena);
+struct report_buf *report_set_buffer(struct report_buf *buf);
+void report(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void report_raw(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+/* [SYN] offset is a file offset, parent_off a cell offset as in the records */
+void diag(enum diag_code code, hive_off_t offset, hive_off_t parent_off,
+		enum record_kind kind, const char *fmt, ...)
+		__attribute__((format(printf, 5, 6)));
+void report_flush(struct report_buf *buf);
+void report_flush_part(struct report_buf *buf, size_t text_pos, size_t text_end,
+		uint32_t first, uint32_t last);
+void report_set_format(enum report_format format);
+enum report_format report_get_format(void);
+struct report_scope *report_scope_new(TALLOC_CTX *mem_ctx, const char *path,
+		enum report_format format);
+struct report_scope *report_get_scope(void);
+struct report_scope *report_use_scope(struct report_scope *scope);
+uint64_t report_findings(void);
+const char *diag_name(enum diag_code code);
+const char *diag_severity_name(enum diag_code code);
+void report_status(const char *path, const char *status, uint32_t cells);
+const char *record_kind_name(enum record_kind kind);
+
+struct ws_pool;
+typedef void (*ws_func)(struct ws_pool *pool, void *arg);
+int ws_run(int threads, ws_func fn, void *arg);
+void ws_spawn(struct ws_pool *pool, ws_func fn, void *arg);
+int ws_worker_id(void);
+
+
+enum record_kind record_kind(const uint8_t *data);
+int record_fits(enum record_kind kind, int size, hive_off_t offset, hive_off_t parent_off);
+int parse_sk (struct hive *hive, uint8_t *data, int size, hive_off_t offset);
+int parse_vk (struct hive *hive, uint8_t *data, int size, hive_off_t offset);
+int parse_ri (struct hive *hive, uint8_t *_ri_ptr, int size, hive_off_t offset);
+int parse_li (struct hive *hive, uint8_t *_li_ptr, int size, hive_off_t offset);
+int parse_lh (struct hive *hive, uint8_t *_lh_ptr, int size, hive_off_t offset);
+int parse_lf (struct hive *hive, uint8_t *_lf_ptr, int size, hive_off_t offset);
+int parse_nk (struct hive *hive, uint8_t *data, int size, hive_off_t offset);
+int parse_db (struct hive *hive, uint8_t *data, int size, hive_off_t offset);
+int read_blocks (struct hive *hive, struct cell_index *index,
+		const struct hbin_entry *hbin, int parse);
+int check_blocks (TALLOC_CTX *mem_ctx, struct hive *hive, struct hbin_list *list, int jobs);
+int cell_index_append(struct cell_index *index, struct cell_index *more);
+struct hbin_list *read_hbin_list(TALLOC_CTX *mem_ctx, struct hive *hive, hive_off_t *bad_offset);
+uint32_t get_hbin_header(struct hive *hive, hive_off_t offset);
+int get_hbin_data_block(struct hive *hive, hive_off_t offset, hive_off_t parent_off,
+		struct hbin_data_block *block);
+int read_regf_header(struct hive *hive);
+uint32_t regf_checksum(const struct regf_block *regf);
 int main (int argc, char **argv);
 
-int parse_tree(TALLOC_CTX *parent_ctx,
-               FILE *fd,
-               long int offset,
-               long int parent_off,
-               const char *expect_type,
-               long int expect_count);
+/* [SYN] Results of check_hive(), also the exit codes */
+#define CHECK_OK	0
+#define CHECK_ERRORS	1
+#define CHECK_NOFILE	2
+#define CHECK_NOMEM	3
+
+/* [SYN] Set by the command line options, libchkregf users leave them alone */
+extern int show_timings;
+extern int show_stats;
+extern int use_cache;
+extern const char *cache_file;
+extern int use_logs;
+extern int dirty_only;
+extern int use_recover;
+
+int check_open_hive(TALLOC_CTX *mem_ctx, struct hive *hive, int jobs, uint32_t *cells);
+int check_hive(TALLOC_CTX *parent_ctx, const char *filename, int jobs, uint32_t *cells);
+const char *check_status_name(int status);
+int check_batch(TALLOC_CTX *mem_ctx, const char **paths, int count,
+		const char *listfile, int jobs, int verbose);
+
+int check_tree(TALLOC_CTX *mem_ctx, struct hive *hive, int jobs);
+int parse_tree(struct hive *hive,
+               struct tree_stack *stack,
+               hive_off_t offset,
+               hive_off_t parent_off,
+               enum tree_expect expect,
+               long int expect_count,
+               struct hbin_data_block *block);
+void tree_stack_free(struct tree_stack *stack);
 
 #endif /* _CHKREGF_H_ */
@@ -0,0 +1,585 @@
+/*
+ * genhive.c  --  Generate synthetic regf registry files
+ *
+ * This program writes regf files with a configurable shape, to be used for
+ * benchmarking and exercising chkregf. The generated files are valid, unless
+ * corruption is requested.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "regf.h"
+
+#define HBIN_HDR_SIZE	0x20
+
+struct gen_key {
+	uint32_t parent;	/* [SYN] index of parent key */
+	uint32_t first_child;	/* [SYN] index of first child */
+	uint32_t child_count;
+	uint32_t name_idx;	/* [SYN] sibling number, used for the name */
+	uint32_t offset;	/* [SYN] offset of the nk cell */
+};
+
+struct gen_opts {
+	uint64_t keys;
+	uint32_t depth;
+	uint32_t fanout;
+	uint32_t values;
+	uint32_t value_size;
+	uint32_t ri_limit;
+	uint32_t frag;
+	uint32_t hbin_size;
+	uint32_t corrupt;
+	const char *list_type;
+	uint64_t target_size;
+	unsigned int seed;
+};
+
+struct gen_hive {
+	uint8_t *buf;
+	uint64_t alloc;
+	uint64_t used;		/* [SYN] bytes used after the regf header */
+	uint64_t hbin_start;	/* [SYN] start of current hbin, relative */
+	uint64_t hbin_end;	/* [SYN] end of current hbin, relative */
+	uint32_t hbin_size;
+	uint32_t frag;
+};
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+
+	if (!p) {
+		fprintf(stderr, "Memory allocation error (%lu bytes)\n",
+				(unsigned long)size);
+		exit(3);
+	}
+	return p;
+}
+
+static uint8_t *hive_ptr(struct gen_hive *h, uint64_t offset)
+{
+	return h->buf + 0x1000 + offset;
+}
+
+static void hive_reserve(struct gen_hive *h, uint64_t size)
+{
+	uint64_t want = 0x1000 + size;
+
+	if (want <= h->alloc) {
+		return;
+	}
+	if (want > 0xFFFFF000ULL + 0x1000) {
+		fprintf(stderr, "Hive would exceed 4 GB, stopping\n");
+		exit(1);
+	}
+	while (h->alloc < want) {
+		h->alloc = h->alloc ? h->alloc * 2 : 0x100000;
+	}
+	h->buf = xrealloc(h->buf, h->alloc);
+}
+
+/* [SYN] Close the current hbin, marking the remaining space as a free cell */
+static void close_hbin(struct gen_hive *h)
+{
+	int32_t rest;
+
+	if (h->hbin_end == 0) {
+		return;
+	}
+	rest = h->hbin_end - h->used;
+	if (rest > 0) {
+		memcpy(hive_ptr(h, h->used), &rest, 4);
+	}
+	h->used = h->hbin_end;
+}
+
+static void open_hbin(struct gen_hive *h, uint32_t need)
+{
+	struct hbin_block hbin;
+	uint32_t size = h->hbin_size;
+
+	close_hbin(h);
+
+	/* [SYN] Large cells get a hbin of their own */
+	while (size < need + HBIN_HDR_SIZE) {
+		size += 0x1000;
+	}
+	hive_reserve(h, h->used + size);
+	memset(hive_ptr(h, h->used), 0, size);
+
+	memset(&hbin, 0, sizeof(hbin));
+	hbin.id = 0x6E696268;
+	hbin.offset_from_first = h->used;
+	hbin.offset_to_next = size;
+	hbin.size = size;
+	memcpy(hive_ptr(h, h->used), &hbin, sizeof(hbin));
+
+	h->hbin_start = h->used;
+	h->hbin_end = h->used + size;
+	h->used += HBIN_HDR_SIZE;
+}
+
+/* [SYN] Allocate a cell with room for size bytes of data, returns its offset */
+static uint32_t alloc_cell(struct gen_hive *h, uint32_t size)
+{
+	uint32_t cell_size = (size + 4 + 7) & ~7;
+	int32_t raw;
+	uint32_t offset;
+
+	if (h->frag && (uint32_t)(rand() % 100) < h->frag) {
+		/* [SYN] Leave a free cell in front of this one */
+		uint32_t gap = 8 * (1 + rand() % 16);
+
+		if (h->hbin_end && h->used + gap + cell_size <= h->hbin_end) {
+			raw = gap;
+			memcpy(hive_ptr(h, h->used), &raw, 4);
+			h->used += gap;
+		}
+	}
+	if (h->hbin_end == 0 || h->used + cell_size > h->hbin_end) {
+		open_hbin(h, cell_size);
+	}
+	offset = h->used;
+	raw = -(int32_t)cell_size;
+	memcpy(hive_ptr(h, offset), &raw, 4);
+	memset(hive_ptr(h, offset) + 4, 0, cell_size - 4);
+	h->used += cell_size;
+	return offset;
+}
+
+static uint8_t *cell_data(struct gen_hive *h, uint32_t offset)
+{
+	return hive_ptr(h, offset) + 4;
+}
+
+static int key_name(char *buf, uint32_t idx)
+{
+	return sprintf(buf, "Key%06lu", (unsigned long)idx);
+}
+
+static uint32_t lh_hash(const char *name)
+{
+	uint32_t hash = 0;
+
+	while (*name) {
+		uint8_t c = *name++;
+
+		if (c >= 'a' && c <= 'z') {
+			c -= 0x20;
+		}
+		hash = hash * 37 + c;
+	}
+	return hash;
+}
+
+/* [SYN] Write a leaf list (lf/lh/li) for count children starting at first */
+static uint32_t write_leaf_list(struct gen_hive *h, struct gen_key *keys,
+		uint32_t first, uint32_t count, const char *type)
+{
+	uint32_t entry = strcmp(type, "li") == 0 ? 4 : 8;
+	uint32_t offset;
+	uint8_t *data;
+	uint16_t c16 = count;
+	uint32_t i;
+
+	offset = alloc_cell(h, 4 + entry * count);
+	data = cell_data(h, offset);
+	memcpy(data, type, 2);
+	memcpy(data + 2, &c16, 2);
+	for (i = 0; i < count; i++) {
+		struct gen_key *k = &keys[first + i];
+		uint8_t *e = data + 4 + i * entry;
+		char name[32];
+
+		key_name(name, k->name_idx);
+		memcpy(e, &k->offset, 4);
+		if (strcmp(type, "lf") == 0) {
+			memcpy(e + 4, name, 4);
+		} else if (strcmp(type, "lh") == 0) {
+			uint32_t hash = lh_hash(name);
+			memcpy(e + 4, &hash, 4);
+		}
+	}
+	return offset;
+}
+
+static uint32_t write_subkey_list(struct gen_hive *h, struct gen_key *keys,
+		struct gen_key *k, const struct gen_opts *o)
+{
+	uint32_t lists, i, offset;
+	uint16_t c16;
+	uint8_t *data;
+	uint32_t *offsets;
+
+	if (!o->ri_limit || k->child_count <= o->ri_limit) {
+		return write_leaf_list(h, keys, k->first_child, k->child_count,
+				o->list_type);
+	}
+	lists = (k->child_count + o->ri_limit - 1) / o->ri_limit;
+	offsets = xrealloc(NULL, lists * sizeof(uint32_t));
+	for (i = 0; i < lists; i++) {
+		uint32_t n = o->ri_limit;
+
+		if ((i + 1) * o->ri_limit > k->child_count) {
+			n = k->child_count - i * o->ri_limit;
+		}
+		offsets[i] = write_leaf_list(h, keys,
+				k->first_child + i * o->ri_limit, n,
+				o->list_type);
+	}
+	offset = alloc_cell(h, 4 + 4 * lists);
+	data = cell_data(h, offset);
+	c16 = lists;
+	memcpy(data, "ri", 2);
+	memcpy(data + 2, &c16, 2);
+	memcpy(data + 4, offsets, 4 * lists);
+	free(offsets);
+	return offset;
+}
+
+/* [SYN] Write value data, big data (db) records for large values */
+static uint32_t write_value_data(struct gen_hive *h, uint32_t size)
+{
+	uint32_t offset, i, segments, list;
+	uint16_t c16;
+	uint8_t *data;
+
+	if (size <= DB_SEGMENT_SIZE) {
+		offset = alloc_cell(h, size);
+		data = cell_data(h, offset);
+		for (i = 0; i < size; i++) {
+			data[i] = i;
+		}
+		return offset;
+	}
+	segments = (size + DB_SEGMENT_SIZE - 1) / DB_SEGMENT_SIZE;
+	list = alloc_cell(h, 4 * segments);
+	for (i = 0; i < segments; i++) {
+		uint32_t seg_size = DB_SEGMENT_SIZE;
+		uint32_t seg;
+
+		if ((i + 1) * DB_SEGMENT_SIZE > size) {
+			seg_size = size - i * DB_SEGMENT_SIZE;
+		}
+		seg = alloc_cell(h, seg_size);
+		memset(cell_data(h, seg), 0xA5, seg_size);
+		memcpy(cell_data(h, list) + 4 * i, &seg, 4);
+	}
+	offset = alloc_cell(h, 8);
+	data = cell_data(h, offset);
+	c16 = segments;
+	memcpy(data, "db", 2);
+	memcpy(data + 2, &c16, 2);
+	memcpy(data + 4, &list, 4);
+	return offset;
+}
+
+static void write_values(struct gen_hive *h, uint32_t nk_offset,
+		const struct gen_opts *o)
+{
+	uint32_t list, i;
+	struct nk_record *nk;
+
+	if (!o->values) {
+		return;
+	}
+	list = alloc_cell(h, 4 * o->values);
+	for (i = 0; i < o->values; i++) {
+		struct vk_record vk;
+		char name[32];
+		uint32_t offset;
+		int len = sprintf(name, "Val%04lu", (unsigned long)i);
+
+		memset(&vk, 0, sizeof(vk));
+		vk.id = 0x6B76;
+		vk.name_length = len;
+		vk.type = REG_BINARY;
+		vk.flag = 0x1;
+		vk.data_length = o->value_size;
+		if (o->value_size <= 4) {
+			vk.data_length |= 0x80000000;
+			vk.data_offset = 0x01020304;
+		} else {
+			vk.data_offset = write_value_data(h, o->value_size);
+		}
+		offset = alloc_cell(h, 0x14 + len);
+		memcpy(cell_data(h, offset), &vk, 0x14);
+		memcpy(cell_data(h, offset) + 0x14, name, len);
+		memcpy(cell_data(h, list) + 4 * i, &offset, 4);
+	}
+	nk = (struct nk_record *)cell_data(h, nk_offset);
+	nk->value_count = o->values;
+	nk->value_offset = list;
+}
+
+/* [SYN] Estimate the number of bytes a key with its values takes */
+static uint64_t bytes_per_key(const struct gen_opts *o)
+{
+	uint64_t size = 0x60 + 8;
+	uint64_t data = 0;
+
+	if (o->value_size > 4) {
+		data = (o->value_size + 4 + 7) & ~7;
+		if (o->value_size > DB_SEGMENT_SIZE) {
+			data += 16 + 4 * (o->value_size / DB_SEGMENT_SIZE + 1) + 8;
+		}
+	}
+	size += o->values * (0x20 + data + 4);
+	if (o->values) {
+		size += 8;
+	}
+	return size;
+}
+
+static struct gen_key *build_tree(const struct gen_opts *o, uint64_t *count)
+{
+	struct gen_key *keys;
+	uint64_t n = 1, cur;
+	uint32_t *level;
+
+	keys = xrealloc(NULL, o->keys * sizeof(*keys));
+	level = xrealloc(NULL, o->keys * sizeof(*level));
+	memset(&keys[0], 0, sizeof(keys[0]));
+	level[0] = 0;
+
+	/* [SYN] Breadth first, every key gets fanout children until we run
+	 * out of keys or reach the maximum depth */
+	for (cur = 0; cur < n && n < o->keys; cur++) {
+		uint32_t i;
+
+		if (level[cur] >= o->depth) {
+			continue;
+		}
+		keys[cur].first_child = n;
+		for (i = 0; i < o->fanout && n < o->keys; i++, n++) {
+			memset(&keys[n], 0, sizeof(keys[n]));
+			keys[n].parent = cur;
+			keys[n].name_idx = i;
+			level[n] = level[cur] + 1;
+			keys[cur].child_count++;
+		}
+	}
+	free(level);
+	*count = n;
+	return keys;
+}
+
+static void corrupt_hive(struct gen_hive *h, struct gen_key *keys,
+		uint64_t count, uint32_t sk, uint32_t corrupt)
+{
+	uint32_t i;
+
+	for (i = 0; i < corrupt && count > 1; i++) {
+		uint64_t idx = 1 + (uint64_t)rand() % (count - 1);
+		struct nk_record *nk;
+
+		nk = (struct nk_record *)cell_data(h, keys[idx].offset);
+		switch (rand() % 5) {
+			case 0: /* [SYN] wrong parent */
+				nk->parent_offset += 8;
+				break;
+			case 1: /* [SYN] wrong subkey count */
+				nk->subkey_count++;
+				if (nk->subkey_offset == 0xFFFFFFFF) {
+					nk->subkey_offset = keys[0].offset;
+				}
+				break;
+			case 2: /* [SYN] free the key cell itself */
+				*(int32_t *)hive_ptr(h, keys[idx].offset) =
+					-*(int32_t *)hive_ptr(h, keys[idx].offset);
+				break;
+			case 3: /* [SYN] break the sk list */
+				((struct sk_record *)cell_data(h, sk))->next_sk_offset = 0;
+				fprintf(stderr, "Corrupted sk at 0x%lx\n",
+						(unsigned long)sk + 0x1000);
+				continue;
+			default: /* [SYN] point into the middle of a cell */
+				nk->sk_offset += 8;
+				break;
+		}
+		fprintf(stderr, "Corrupted key at 0x%lx\n",
+				(unsigned long)keys[idx].offset + 0x1000);
+	}
+}
+
+static void usage(void)
+{
+	puts("Usage: genhive [options] OUTFILE\n"
+	     "  -k N      number of keys (default 1000)\n"
+	     "  -m SIZE   approximate target file size in bytes, overrides -k\n"
+	     "  -d N      maximum depth (default 8)\n"
+	     "  -f N      fan-out per key (default 16)\n"
+	     "  -v N      values per key (default 2)\n"
+	     "  -s N      value data size in bytes (default 16)\n"
+	     "  -l TYPE   subkey list type: lf, lh or li (default lf)\n"
+	     "  -r N      split subkey lists larger than N with an ri record\n"
+	     "  -F PCT    fragmentation, percentage of cells preceded by a free cell\n"
+	     "  -b SIZE   hbin size, multiple of 4096 (default 4096)\n"
+	     "  -c N      apply N random corruptions\n"
+	     "  -S SEED   random seed (default 1)");
+}
+
+int main (int argc, char **argv)
+{
+	struct gen_opts o;
+	struct gen_hive h;
+	struct gen_key *keys;
+	struct regf_block regf;
+	uint64_t count, i;
+	uint32_t sk, *dword;
+	FILE *fd;
+	int c;
+
+	memset(&o, 0, sizeof(o));
+	o.keys = 1000;
+	o.depth = 8;
+	o.fanout = 16;
+	o.values = 2;
+	o.value_size = 16;
+	o.hbin_size = 0x1000;
+	o.list_type = "lf";
+	o.seed = 1;
+
+	while ((c = getopt(argc, argv, "k:m:d:f:v:s:l:r:F:b:c:S:h")) != -1) {
+		switch (c) {
+			case 'k': o.keys = strtoull(optarg, NULL, 0); break;
+			case 'm': o.target_size = strtoull(optarg, NULL, 0); break;
+			case 'd': o.depth = strtoul(optarg, NULL, 0); break;
+			case 'f': o.fanout = strtoul(optarg, NULL, 0); break;
+			case 'v': o.values = strtoul(optarg, NULL, 0); break;
+			case 's': o.value_size = strtoul(optarg, NULL, 0); break;
+			case 'l': o.list_type = optarg; break;
+			case 'r': o.ri_limit = strtoul(optarg, NULL, 0); break;
+			case 'F': o.frag = strtoul(optarg, NULL, 0); break;
+			case 'b': o.hbin_size = strtoul(optarg, NULL, 0); break;
+			case 'c': o.corrupt = strtoul(optarg, NULL, 0); break;
+			case 'S': o.seed = strtoul(optarg, NULL, 0); break;
+			default: usage(); return 1;
+		}
+	}
+	if (optind != argc - 1 || o.fanout == 0 || o.fanout > 0xFFFF ||
+			o.hbin_size == 0 || o.hbin_size % 0x1000 != 0 ||
+			(strcmp(o.list_type, "lf") && strcmp(o.list_type, "lh") &&
+			 strcmp(o.list_type, "li"))) {
+		usage();
+		return 1;
+	}
+	if (o.ri_limit == 0 && o.fanout > 0xFFFF / 8) {
+		o.ri_limit = 0xFFFF / 8;
+	}
+	if (o.target_size) {
+		o.keys = o.target_size / bytes_per_key(&o);
+		if (o.keys < 1) {
+			o.keys = 1;
+		}
+		/* [SYN] Make sure the tree can actually hold that many keys */
+		while (o.depth < 64) {
+			uint64_t cap = 1, width = 1;
+			uint32_t d;
+
+			for (d = 0; d < o.depth && cap < o.keys; d++) {
+				width *= o.fanout;
+				cap += width;
+			}
+			if (cap >= o.keys) {
+				break;
+			}
+			o.depth++;
+		}
+	}
+	srand(o.seed);
+
+	memset(&h, 0, sizeof(h));
+	h.hbin_size = o.hbin_size;
+	h.frag = o.frag;
+
+	keys = build_tree(&o, &count);
+
+	/* [SYN] Root key first, so it ends up at 0x20 */
+	for (i = 0; i < count; i++) {
+		char name[32];
+		int len = i ? key_name(name, keys[i].name_idx) : sprintf(name, "ROOT");
+
+		keys[i].offset = alloc_cell(&h, 0x4C + len);
+		memcpy(cell_data(&h, keys[i].offset) + 0x4C, name, len);
+	}
+	sk = alloc_cell(&h, 0x14 + 20);
+	{
+		struct sk_record *skr = (struct sk_record *)cell_data(&h, sk);
+		uint8_t sd[20] = { 1, 0, 0x04, 0x80 };
+
+		skr->id = 0x6B73;
+		skr->prev_sk_offset = sk;
+		skr->next_sk_offset = sk;
+		skr->usage_counter = count;
+		skr->size = sizeof(sd);
+		memcpy(&skr->data, sd, sizeof(sd));
+	}
+	for (i = 0; i < count; i++) {
+		struct nk_record nk;
+		struct gen_key *k = &keys[i];
+		char name[32];
+
+		memset(&nk, 0, sizeof(nk));
+		nk.id = 0x6B6E;
+		nk.type = i ? 0x20 : 0x2C;
+		nk.parent_offset = i ? keys[k->parent].offset : 0x00000048;
+		nk.subkey_count = k->child_count;
+		nk.subkey_offset = 0xFFFFFFFF;
+		nk.uk3 = -1;
+		nk.value_offset = -1;
+		nk.sk_offset = sk;
+		nk.classname_offset = -1;
+		nk.keyname_length = i ? key_name(name, k->name_idx) : 4;
+		memcpy(cell_data(&h, k->offset), &nk, 0x4C);
+		if (k->child_count) {
+			uint32_t list = write_subkey_list(&h, keys, k, &o);
+			((struct nk_record *)cell_data(&h, k->offset))->subkey_offset = list;
+		}
+		write_values(&h, k->offset, &o);
+	}
+	close_hbin(&h);
+
+	corrupt_hive(&h, keys, count, sk, o.corrupt);
+
+	memset(&regf, 0, sizeof(regf));
+	regf.id = 0x66676572;
+	regf.uk1[0] = regf.uk1[1] = 1;
+	regf.version[0] = 1;
+	regf.version[1] = 5;
+	regf.version[2] = 0;
+	regf.version[3] = 1;
+	regf.key_offset = keys[0].offset;
+	regf.data_size = h.used;
+	regf.uk2 = 1;
+	for (i = 0; i < 0x1FC / 4; i++) {
+		dword = (uint32_t *) &regf + i;
+		regf.checksum ^= *dword;
+	}
+	hive_reserve(&h, 0);
+	memset(h.buf, 0, 0x1000);
+	memcpy(h.buf, &regf, sizeof(regf));
+
+	if (!(fd = fopen(argv[optind], "w"))) {
+		perror(argv[optind]);
+		return 2;
+	}
+	if (fwrite(h.buf, 0x1000 + h.used, 1, fd) != 1 || fclose(fd) != 0) {
+		perror(argv[optind]);
+		return 2;
+	}
+	fprintf(stderr, "Wrote %lu keys, %lu bytes\n", (unsigned long)count,
+			(unsigned long)(0x1000 + h.used));
+	free(keys);
+	free(h.buf);
+	return 0;
+}
@@ -0,0 +1,382 @@
+/*
+ * hive.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the hive source. Files are memory mapped; stdin and
+ * pipes are read strictly front to back into a buffer, as far as the views
+ * asked for so far need. The buffer only takes up memory as the data
+ * arrives. Library callers hand in a buffer of their own, or a
+ * read callback that is used like a pipe. All record access goes through
+ * bounds checked views, no data is copied.
+ *
+ * Transaction logs are applied to the hive in memory. Mapped files are
+ * mapped privately, so only the pages the logs write to are copied, and the
+ * file itself is never changed.
+ */
+
+/* [SYN] For mremap() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+/* [SYN] Largest hive a regf header can describe */
+#define HIVE_STREAM_MAX		(0x1000 + (uint64_t)0xFFFFF000)
+
+/* [SYN] The stream buffer is made usable this much at a time */
+#define HIVE_STREAM_CHUNK	0x100000
+
+/* [SYN] A hive that can only be read sequentially */
+struct hive_stream {
+	chkregf_read_fn read;
+	void *private_data;
+	int fd;				/* [SYN] -1 unless read from a file descriptor */
+	int eof;
+	uint64_t avail;			/* [SYN] bytes read into the buffer */
+	uint64_t committed;		/* [SYN] bytes of the buffer made usable */
+	uint64_t reserved;		/* [SYN] size of the buffer mapping */
+	pthread_mutex_t lock;		/* [SYN] views can come from any worker */
+};
+
+/* [SYN] Make the buffer usable up to at least end. The pages past it are
+ * only address space, they take no memory until the data gets there. */
+static int hive_commit(struct hive *hive, uint64_t end)
+{
+	struct hive_stream *stream = hive->stream;
+
+	if (end <= stream->committed) {
+		return 1;
+	}
+	end = (end + HIVE_STREAM_CHUNK - 1) / HIVE_STREAM_CHUNK * HIVE_STREAM_CHUNK;
+	if (end > stream->reserved) {
+		end = stream->reserved;
+	}
+	if (mprotect(hive->base + stream->committed, end - stream->committed,
+				PROT_READ | PROT_WRITE) == -1) {
+		return 0;
+	}
+	stream->committed = end;
+	return 1;
+}
+
+/* [SYN] Read from the stream until the first end bytes are in the buffer */
+static int hive_fill(struct hive *hive, uint64_t end)
+{
+	struct hive_stream *stream = hive->stream;
+	uint64_t avail;
+
+	if (__atomic_load_n(&stream->avail, __ATOMIC_ACQUIRE) >= end) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&stream->lock);
+	avail = stream->avail;
+	while (avail < end && !stream->eof) {
+		size_t want = hive->size - avail;
+		ssize_t got;
+
+		if (want > HIVE_STREAM_CHUNK) {
+			want = HIVE_STREAM_CHUNK;
+		}
+		if (!hive_commit(hive, avail + want)) {
+			stream->eof = 1;
+			break;
+		}
+		got = stream->read(stream->private_data, hive->base + avail, want);
+		if (got <= 0) {
+			stream->eof = 1;
+			break;
+		}
+		avail += got;
+		hive->stats.reads++;
+		hive->stats.read_bytes += got;
+		/* [SYN] Publish the size only after the data is in place */
+		__atomic_store_n(&stream->avail, avail, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&stream->lock);
+	return avail >= end;
+}
+
+static ssize_t fd_read(void *private_data, void *buf, size_t len)
+{
+	int fd = *(int *)private_data;
+	ssize_t got;
+
+	do {
+		got = read(fd, buf, len);
+	} while (got < 0 && errno == EINTR);
+	return got;
+}
+
+/* [SYN] How big a stream can be. The size in the regf header is only
+ * believed if the header checksum is right and the size is whole pages;
+ * otherwise the stream is read until it ends, up to the largest hive
+ * there can be. */
+static uint64_t stream_size(const struct regf_block *regf, uint64_t got)
+{
+	if (got < sizeof(*regf)) {
+		return got;
+	}
+	if (regf_checksum(regf) == regf->checksum && regf->data_size != 0 &&
+			regf->data_size % 0x1000 == 0) {
+		return 0x1000 + (uint64_t)regf->data_size;
+	}
+	return HIVE_STREAM_MAX;
+}
+
+/* [SYN] The buffer is mapped once at the size the header allows, so views
+ * stay valid while more is read, but only address space is taken for it;
+ * it grows as the hbins arrive. A stream is either read through fn, or
+ * from fd if that is 0 or more. */
+static struct hive *hive_open_stream(TALLOC_CTX *mem_ctx, chkregf_read_fn fn,
+		void *private_data, int fd)
+{
+	struct regf_block regf;
+	struct hive_stream *stream;
+	struct hive *hive;
+	uint64_t got = 0, page = sysconf(_SC_PAGESIZE);
+	void *base;
+
+	if (fd >= 0) {
+		fn = fd_read;
+		private_data = &fd;
+	}
+	while (got < sizeof(regf)) {
+		ssize_t n = fn(private_data, (uint8_t *)&regf + got, sizeof(regf) - got);
+
+		if (n < 0) {
+			return NULL;
+		}
+		if (n == 0) {
+			break;
+		}
+		got += n;
+	}
+
+	hive = talloc_zero(mem_ctx, struct hive);
+	stream = hive ? talloc_zero(hive, struct hive_stream) : NULL;
+	if (!stream) {
+		talloc_free(hive);
+		errno = ENOMEM;
+		return NULL;
+	}
+	hive->size = stream_size(&regf, got);
+	stream->reserved = (hive->size + page - 1) / page * page;
+	if (stream->reserved < page) {
+		stream->reserved = page;
+	}
+	base = mmap(NULL, stream->reserved, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		talloc_free(hive);
+		errno = ENOMEM;
+		return NULL;
+	}
+	hive->base = base;
+	hive->stream = stream;
+	if (!hive_commit(hive, got)) {
+		munmap(base, stream->reserved);
+		talloc_free(hive);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(hive->base, &regf, got);
+
+	stream->read = fn;
+	stream->private_data = fd >= 0 ? &stream->fd : private_data;
+	stream->fd = fd;
+	stream->avail = got;
+	stream->eof = got < sizeof(regf);
+	pthread_mutex_init(&stream->lock, NULL);
+	return hive;
+}
+
+/* [SYN] Open a hive file. "-" is stdin; anything that isn't a regular file
+ * (a pipe, a character device) is read as a stream, without seeking. */
+struct hive *hive_open(TALLOC_CTX *mem_ctx, const char *filename)
+{
+	struct hive *hive;
+	struct stat st;
+	int fd;
+
+	if (strcmp(filename, "-") == 0) {
+		return hive_open_stream(mem_ctx, NULL, NULL, STDIN_FILENO);
+	}
+	if ((fd = open(filename, O_RDONLY)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		if (!(hive = hive_open_stream(mem_ctx, NULL, NULL, fd))) {
+			int err = errno;
+
+			close(fd);
+			errno = err;
+		}
+		return hive;
+	}
+	if (st.st_size == 0) {
+		/* [SYN] Can't map an empty file, but it is no hive either */
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	hive = talloc_zero(mem_ctx, struct hive);
+	if (!hive) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	hive->size = st.st_size;
+	hive->base = mmap(NULL, hive->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hive->base == MAP_FAILED) {
+		talloc_free(hive);
+		return NULL;
+	}
+
+	/* [SYN] Pass 2 walks the file front to back */
+	madvise(hive->base, hive->size, MADV_SEQUENTIAL);
+	return hive;
+}
+
+/* [SYN] A hive that is in memory already. It is only read, never written. */
+struct hive *hive_open_buffer(TALLOC_CTX *mem_ctx, const void *buf, uint64_t len)
+{
+	struct hive *hive = talloc_zero(mem_ctx, struct hive);
+
+	if (!hive) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	hive->base = (uint8_t *)buf;
+	hive->size = len;
+	hive->borrowed = 1;
+	return hive;
+}
+
+/* [SYN] A hive read through a callback, like a pipe */
+struct hive *hive_open_read(TALLOC_CTX *mem_ctx, chkregf_read_fn fn, void *private_data)
+{
+	return hive_open_stream(mem_ctx, fn, private_data, -1);
+}
+
+void hive_close(struct hive *hive)
+{
+	if (hive->cache) {
+		cache_close(hive);
+	}
+	if (hive->stream) {
+		if (hive->stream->fd >= 0 && hive->stream->fd != STDIN_FILENO) {
+			close(hive->stream->fd);
+		}
+		pthread_mutex_destroy(&hive->stream->lock);
+		munmap(hive->base, hive->stream->reserved);
+	} else if (!hive->borrowed) {
+		munmap(hive->base, hive->size);
+	}
+	talloc_free(hive);
+}
+
+/* [SYN] Make the hive writable, and at least size bytes long. Anything past
+ * the end of the file reads as zeroes. Views taken before are invalid
+ * afterwards, so this is only done before pass 1. */
+int hive_overlay(struct hive *hive, uint64_t size)
+{
+	uint8_t *base;
+
+	if (hive->borrowed) {
+		errno = EINVAL;
+		return 0;
+	}
+	if (hive->stream) {
+		struct hive_stream *stream = hive->stream;
+		int complete = hive_fill(hive, hive->size);
+
+		/* [SYN] The logs may write anywhere up to size. What lies past
+		 * the data is still untouched, so it reads as zeroes. */
+		if (!hive_commit(hive, size > hive->size ? size : hive->size)) {
+			errno = ENOMEM;
+			return 0;
+		}
+		if (size <= hive->size) {
+			return 1;
+		}
+		if (size > stream->reserved) {
+			uint64_t page = sysconf(_SC_PAGESIZE);
+			uint64_t reserved = (size + page - 1) / page * page;
+
+			/* [SYN] All of it is committed now, one mapping */
+			base = mremap(hive->base, stream->reserved, reserved, MREMAP_MAYMOVE);
+			if (base == MAP_FAILED) {
+				errno = ENOMEM;
+				return 0;
+			}
+			hive->base = base;
+			stream->reserved = stream->committed = reserved;
+		}
+		/* [SYN] A stream that ended early stays short */
+		if (complete) {
+			stream->avail = size;
+		}
+		hive->size = size;
+		return 1;
+	}
+
+	if (size > hive->size) {
+		uint64_t page = sysconf(_SC_PAGESIZE);
+		uint64_t mapped = (hive->size + page - 1) / page * page;
+
+		base = mremap(hive->base, hive->size, size, MREMAP_MAYMOVE);
+		if (base == MAP_FAILED) {
+			return 0;
+		}
+		hive->base = base;
+		hive->size = size;
+		/* [SYN] Pages past the end of the file can't be touched, those
+		 * become anonymous memory */
+		if (size > mapped && mmap(base + mapped, size - mapped,
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+					-1, 0) == MAP_FAILED) {
+			return 0;
+		}
+	}
+	return mprotect(hive->base, hive->size, PROT_READ | PROT_WRITE) == 0;
+}
+
+uint8_t *hive_view(struct hive *hive, uint64_t offset, uint64_t len)
+{
+	/* [SYN] Written this way so offset + len can't overflow */
+	if (offset > hive->size || len > hive->size - offset) {
+		return NULL;
+	}
+	if (hive->stream && !hive_fill(hive, offset + len)) {
+		return NULL;
+	}
+	return hive->base + offset;
+}
@@ -0,0 +1,97 @@
+/*
+ * libchkregf.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the library interface. The passes run as they do for
+ * the command line, with diag() collecting this thread's findings into a
+ * buffer of our own, in file order. That buffer becomes the result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+static void lib_check(struct chkregf_result *result, struct hive *hive, int jobs)
+{
+	struct report_scope *saved_scope;
+	struct report_buf *out, *saved_buf;
+	struct report_scope *scope;
+	TALLOC_CTX *mem_ctx;
+
+	if (!hive) {
+		result->status = errno == ENOMEM ? CHECK_NOMEM : CHECK_NOFILE;
+		return;
+	}
+
+	mem_ctx = talloc_new(result);
+	out = mem_ctx ? report_buf_new(mem_ctx) : NULL;
+	scope = out ? report_scope_new(mem_ctx, NULL, REPORT_FINDINGS) : NULL;
+	if (!scope) {
+		result->status = CHECK_NOMEM;
+		hive_close(hive);
+		talloc_free(mem_ctx);
+		return;
+	}
+
+	saved_buf = report_set_buffer(out);
+	saved_scope = report_use_scope(scope);
+	result->status = check_open_hive(mem_ctx, hive, jobs, &result->cells);
+	report_use_scope(saved_scope);
+	report_set_buffer(saved_buf);
+	hive_close(hive);
+
+	if (out->lost) {
+		result->status = CHECK_NOMEM;
+	}
+	result->findings = talloc_steal(result, out)->findings;
+	result->count = out->count;
+	talloc_free(mem_ctx);
+}
+
+struct chkregf_result *chkregf_check_buffer(const void *buf, size_t len, int jobs)
+{
+	struct chkregf_result *result = talloc_zero(NULL, struct chkregf_result);
+
+	if (!result) {
+		return NULL;
+	}
+	lib_check(result, hive_open_buffer(result, buf, len), jobs);
+	return result;
+}
+
+struct chkregf_result *chkregf_check_read(chkregf_read_fn fn, void *private_data,
+		int jobs)
+{
+	struct chkregf_result *result = talloc_zero(NULL, struct chkregf_result);
+
+	if (!result) {
+		return NULL;
+	}
+	errno = 0;
+	lib_check(result, hive_open_read(result, fn, private_data), jobs);
+	return result;
+}
+
+void chkregf_result_free(struct chkregf_result *result)
+{
+	talloc_free(result);
+}
+
+const char *chkregf_status_name(int status)
+{
+	return check_status_name(status);
+}
@@ -0,0 +1,63 @@
+/*
+ * libchkregf.h  --  Check regf registry files
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * The checker as a library. A hive is checked from memory, without copying
+ * it, or from a read callback, front to back. The findings come back as a
+ * list instead of being printed. Every call is independent of the others,
+ * so hives can be checked from several threads at the same time.
+ */
+
+#ifndef _LIBCHKREGF_H_
+#define _LIBCHKREGF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* [SYN] Outcome of a check, the same as the exit codes of chkregf */
+#define CHKREGF_OK		0
+#define CHKREGF_ERRORS		1
+#define CHKREGF_NOFILE		2	/* [SYN] the hive could not be read */
+#define CHKREGF_NOMEM		3
+
+struct chkregf_finding {
+	const char *code;		/* [SYN] e.g. "nk-parent", as in --format=json */
+	const char *severity;		/* [SYN] "error", "warning" or "debug" */
+	const char *kind;		/* [SYN] record kind, "nk", "lf", ... or NULL */
+	uint64_t offset;		/* [SYN] file offset of the cell, 0 if unknown */
+	uint64_t parent;		/* [SYN] the cell referring to it, 0 if unknown */
+	const char *message;		/* [SYN] the text chkregf prints for it */
+};
+
+struct chkregf_result {
+	int status;			/* [SYN] CHKREGF_OK, CHKREGF_ERRORS, ... */
+	uint32_t cells;			/* [SYN] cells found in pass 2 */
+	uint32_t count;
+	struct chkregf_finding *findings;
+};
+
+/* [SYN] All libchkregf.so exports, everything else in it is hidden */
+#define CHKREGF_API __attribute__((visibility("default")))
+
+/* [SYN] Read up to len bytes into buf. Returns the number read, 0 at the
+ * end and -1 on errors. */
+typedef ssize_t (*chkregf_read_fn)(void *private_data, void *buf, size_t len);
+
+/* [SYN] Check len bytes at buf, which have to stay in place until the call
+ * returns. jobs is the number of threads for pass 2 and 3. Returns NULL if
+ * there's no memory for the result. */
+CHKREGF_API struct chkregf_result *chkregf_check_buffer(const void *buf, size_t len, int jobs);
+
+/* [SYN] Check a hive read through fn, which is called from any of the
+ * threads but never from two at a time. */
+CHKREGF_API struct chkregf_result *chkregf_check_read(chkregf_read_fn fn, void *private_data,
+		int jobs);
+
+CHKREGF_API void chkregf_result_free(struct chkregf_result *result);
+CHKREGF_API const char *chkregf_status_name(int status);
+
+#endif /* _LIBCHKREGF_H_ */
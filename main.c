@@ -0,0 +1,175 @@
+/*
+ * main.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2005-2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the command line program. The checking itself is in
+ * libchkregf.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <talloc.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+static void usage(void)
+{
+	puts("Usage: chkregf [-t] [--stats[=json]] [-j JOBS] REGFILE\n"
+	     "       chkregf [-t] [--stats[=json]] [-j JOBS] - < REGFILE\n"
+	     "       chkregf -b [-v] [-j JOBS] [-L LISTFILE] [PATH...]\n"
+	     "  -j JOBS      check with JOBS threads in pass 2 and 3, or check\n"
+	     "               JOBS hives at a time in batch mode\n"
+	     "  -b           batch mode, one summary line per hive; PATH may be a\n"
+	     "               directory, all files in it are checked\n"
+	     "  -L LISTFILE  batch mode, read paths from LISTFILE ('-' for stdin)\n"
+	     "  -v           batch mode, include the full report of every hive\n"
+	     "  -t           report the time taken by pass 1 to 3\n"
+	     "  --stats      report time, cells, bytes and memory used per pass,\n"
+	     "               --stats=json prints them as one JSON object\n"
+	     "  --format=FMT text (the default) or json: one JSON object per\n"
+	     "               finding and one with the outcome per hive\n"
+	     "  --cache[=FILE] keep what a check without findings learned in FILE,\n"
+	     "               REGFILE.chkcache by default, and only check what\n"
+	     "               changed since then the next time\n"
+	     "  --logs       apply REGFILE.LOG1 and .LOG2 (or .LOG) in memory first,\n"
+	     "               and check the hive as Windows would load it\n"
+	     "  --dirty-only like --logs, but pass 2 only checks the records in\n"
+	     "               hbins the logs changed\n"
+	     "  --recover    carry on past broken hbin headers and cells, and search\n"
+	     "               the damaged parts for cells to check\n"
+	     "REGFILE '-' reads the hive from stdin. Pipes and stdin are read front\n"
+	     "to back only, so a hive can be checked straight out of a decompressor.");
+}
+
+int main (int argc, char **argv)
+{
+	int jobs = 1;
+	int batch = 0;
+	int verbose = 0;
+	const char *listfile = NULL;
+	int c, rv;
+	TALLOC_CTX *mem_ctx;
+	static const struct option long_options[] = {
+		{ "stats", optional_argument, NULL, 's' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "cache", optional_argument, NULL, 'c' },
+		{ "logs", no_argument, NULL, 'l' },
+		{ "dirty-only", no_argument, NULL, 'd' },
+		{ "recover", no_argument, NULL, 'r' },
+		{ NULL, 0, NULL, 0 }
+	};
+	
+	while ((c = getopt_long(argc, argv, "bj:L:tv", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'f':
+				if (strcmp(optarg, "json") == 0) {
+					report_set_format(REPORT_JSON);
+				} else if (strcmp(optarg, "text") == 0) {
+					report_set_format(REPORT_HUMAN);
+				} else {
+					usage();
+					return 1;
+				}
+				break;
+			case 'c':
+				use_cache = 1;
+				cache_file = optarg;
+				break;
+			case 'd':
+				dirty_only = 1;
+				/* [SYN] fall through */
+			case 'l':
+				use_logs = 1;
+				break;
+			case 'r':
+				use_recover = 1;
+				break;
+			case 's':
+				if (!optarg) {
+					show_stats = 1;
+				} else if (strcmp(optarg, "json") == 0) {
+					show_stats = 2;
+				} else {
+					usage();
+					return 1;
+				}
+				break;
+			case 'b':
+				batch = 1;
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				if (jobs < 1) {
+					usage();
+					return 1;
+				}
+				break;
+			case 'L':
+				batch = 1;
+				listfile = optarg;
+				break;
+			case 't':
+				show_timings = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if ((!batch && optind != argc - 1) || (batch && !listfile && optind == argc)) {
+		usage();
+		return 1;
+	}
+	/* [SYN] One cache file per hive, and stdin has no name to put one next to */
+	if (use_cache && (cache_file ? batch : !batch && strcmp(argv[optind], "-") == 0)) {
+		usage();
+		return 1;
+	}
+	/* [SYN] Logs are found by the name of the hive as well */
+	if (use_logs && !batch && strcmp(argv[optind], "-") == 0) {
+		usage();
+		return 1;
+	}
+
+	/* [SYN] Findings can run into the tens of thousands, when nobody is
+	 * watching there's no need to pass them on line by line */
+	if (!isatty(STDOUT_FILENO)) {
+		setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+	}
+
+	mem_ctx = talloc_init("chkregf registry checker");
+	if (!mem_ctx) {
+		printf("Memory allocation error\n");
+		return 3;
+	}
+
+	if (batch) {
+		rv = check_batch(mem_ctx, (const char **)&argv[optind], argc - optind,
+				listfile, jobs, verbose);
+	} else {
+		uint32_t cells;
+
+		rv = check_hive(mem_ctx, argv[optind], jobs, &cells);
+		if (report_get_format() == REPORT_JSON) {
+			report_status(argv[optind], check_status_name(rv), cells);
+		}
+	}
+	talloc_free(mem_ctx);
+	return rv;
+}
@@ -0,0 +1,151 @@
+/*
+ * mkupcase.c  --  Generate the upcase table of chkregf
+ *
+ * This program reads upcase.txt on stdin and writes upcase.c on stdout, the
+ * table upcase() in chkregf.h uses. It is run by the Makefile whenever
+ * upcase.txt changes.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+static uint16_t delta[0x10000];
+static uint8_t page[256];
+static uint16_t pages[256];	/* [SYN] first character of each delta page */
+
+/* [SYN] One "first last step delta" line of upcase.txt into delta[] */
+static int read_range(char *p)
+{
+	long field[4], c;
+	char *end;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		field[i] = strtol(p, &end, 0);
+		if (end == p) {
+			return 0;
+		}
+		p = end;
+	}
+	if (field[0] < 0 || field[1] > 0xFFFF || field[0] > field[1] || field[2] < 1) {
+		return 0;
+	}
+	for (c = field[0]; c <= field[1]; c += field[2]) {
+		delta[c] = (uint16_t)field[3];
+	}
+	return 1;
+}
+
+static int read_ranges(FILE *in)
+{
+	char line[256];
+	unsigned long lineno = 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		char *p = line + strspn(line, " \t");
+
+		lineno++;
+		if (*p == '#' || *p == '\n' || *p == '\0') {
+			continue;
+		}
+		if (!read_range(p)) {
+			fprintf(stderr, "upcase.txt:%lu: expected first last step delta\n",
+					lineno);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* [SYN] Give every page of 256 characters a delta page. Pages without any
+ * mapping share page 0, equal pages share one. */
+static unsigned int build_pages(void)
+{
+	unsigned int count = 1, i, j;
+
+	for (i = 0; i < 256; i++) {
+		page[i] = 0;
+		for (j = 0; j < 256; j++) {
+			if (delta[i * 256 + j]) {
+				break;
+			}
+		}
+		if (j == 256) {
+			continue;
+		}
+		for (j = 1; j < count; j++) {
+			if (!memcmp(&delta[pages[j] * 256], &delta[i * 256], 256 * sizeof(uint16_t))) {
+				break;
+			}
+		}
+		if (j == count) {
+			pages[count++] = i;
+		}
+		page[i] = j;
+	}
+	return count;
+}
+
+static void write_table(FILE *out, unsigned int count)
+{
+	unsigned int i, j;
+
+	fprintf(out,
+		"/*\n"
+		" * upcase.c  --  Check regf registry files\n"
+		" *\n"
+		" * This program is not meant for end-users, but for developers and skillful\n"
+		" * system administrators. It is meant to point out regf file inconsistencies\n"
+		" * in a manner that it's easy to fix them, so that Windows will parse them\n"
+		" * correctly.\n"
+		" *\n"
+		" * Licensed under the GNU GPL v2 or any later version\n"
+		" *\n"
+		" * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>\n"
+		" *\n"
+		" * This file contains the upcase table for key names, as the amount to add\n"
+		" * to a character, modulo 0x10000. It is split in pages of 256 characters;\n"
+		" * pages without any mapping share page 0.\n"
+		" *\n"
+		" * Generated by mkupcase from upcase.txt, do not edit. See upcase() in\n"
+		" * chkregf.h for its use.\n"
+		" */\n"
+		"\n"
+		"#include <stdint.h>\n"
+		"#include <talloc.h>\n"
+		"#include \"regf.h\"\n"
+		"#include \"chkregf.h\"\n"
+		"\n"
+		"const uint8_t upcase_page[256] = {\n");
+	for (i = 0; i < 256; i++) {
+		fprintf(out, "%s%2u,%s", i % 16 ? " " : "\t", page[i],
+				i % 16 == 15 ? "\n" : "");
+	}
+	fprintf(out, "};\n\nconst uint16_t upcase_delta[%u][256] = {\n", count);
+	fprintf(out, "\t[0] = { 0 },\n");
+	for (i = 1; i < count; i++) {
+		fprintf(out, "\t[%u] = {\t/* [SYN] U+%02X00 */\n", i, pages[i]);
+		for (j = 0; j < 256; j++) {
+			fprintf(out, "%s0x%04X,%s", j % 8 ? " " : "\t\t",
+					delta[pages[i] * 256 + j], j % 8 == 7 ? "\n" : "");
+		}
+		fprintf(out, "\t},\n");
+	}
+	fprintf(out, "};\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (!read_ranges(stdin)) {
+		return 1;
+	}
+	write_table(stdout, build_pages());
+	return ferror(stdout) ? 1 : 0;
+}
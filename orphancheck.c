@@ -0,0 +1,87 @@
+/*
+ * orphancheck.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains pass 4. Pass 3 marks every cell it reaches in a bitmap
+ * with one bit per 8 bytes of hive data; allocated cells from pass 2 whose
+ * bit isn't set are orphans, space Windows will never give back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+/* [SYN] Cells are 8 byte aligned, so that is all the resolution needed */
+int reached_init(struct hive *hive)
+{
+	hive->reached_bits = ((uint64_t)hive->regf.data_size + 7) / 8;
+	hive->reached = talloc_zero_array(hive, uint64_t,
+			(hive->reached_bits + 63) / 64);
+	return hive->reached != NULL;
+}
+
+/* [SYN] Called for every cell pass 3 resolves, from any worker */
+void reached_mark(struct hive *hive, uint32_t offset)
+{
+	uint64_t bit = offset / 8;
+
+	if (!hive->reached || bit >= hive->reached_bits) {
+		return;
+	}
+	__atomic_fetch_or(&hive->reached[bit / 64], (uint64_t)1 << (bit % 64),
+			__ATOMIC_RELAXED);
+}
+
+static int reached_test(struct hive *hive, uint32_t offset)
+{
+	uint64_t bit = offset / 8;
+
+	if (bit >= hive->reached_bits) {
+		return 0;
+	}
+	return (hive->reached[bit / 64] >> (bit % 64)) & 1;
+}
+
+/* [SYN] Pass 4, one sweep over the cells of pass 2 */
+int check_orphans(struct hive *hive)
+{
+	struct cell_index *index = hive->index;
+	uint64_t orphans = 0, bytes = 0;
+	uint32_t i;
+
+	if (!hive->reached) {
+		return 1;
+	}
+	for (i = 0; i < index->count; i++) {
+		struct cell_entry *cell = &index->cells[i];
+
+		if (!cell->allocated || reached_test(hive, cell->offset)) {
+			continue;
+		}
+		diag(DIAG_ORPHAN, (long)cell->offset+0x1000, 0, cell->type,
+				"unreferenced cell at 0x%lx, size 0x%lx\n",
+				(long)cell->offset+0x1000, (long)cell->size);
+		orphans++;
+		bytes += cell->size;
+	}
+	if (orphans) {
+		diag(DIAG_ORPHAN_TOTAL, 0, 0, RECORD_UNKNOWN,
+				"%llu unreferenced cells, 0x%llx bytes in total\n",
+				(unsigned long long)orphans, (unsigned long long)bytes);
+	}
+	return 1;
+}
@@ -0,0 +1,209 @@
+/*
+ * pool.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains a small work stealing thread pool. Every worker has its
+ * own deque of tasks; it pushes and pops at the bottom, idle workers steal
+ * from the top of somebody else's deque. The pool is done when no tasks are
+ * pending anymore.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+struct ws_task {
+	ws_func fn;
+	void *arg;
+};
+
+struct ws_worker {
+	struct ws_pool *pool;
+	int id;
+	pthread_mutex_t lock;
+	struct ws_task *tasks;		/* [SYN] tasks[head] .. tasks[tail-1] */
+	size_t head;			/* [SYN] thieves take from here */
+	size_t tail;			/* [SYN] the owner works here */
+	size_t alloc;
+};
+
+struct ws_pool {
+	struct ws_worker *workers;
+	int count;
+	long pending;			/* [SYN] tasks queued or running */
+};
+
+static __thread struct ws_worker *ws_self;
+
+static int ws_push(struct ws_worker *w, ws_func fn, void *arg)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->tail == w->alloc) {
+		if (w->head > 0) {
+			/* [SYN] Reuse the room thieves left at the top */
+			memmove(w->tasks, &w->tasks[w->head],
+					(w->tail - w->head) * sizeof(struct ws_task));
+			w->tail -= w->head;
+			w->head = 0;
+		} else {
+			size_t alloc = w->alloc ? w->alloc * 2 : 256;
+			struct ws_task *tasks;
+
+			tasks = realloc(w->tasks, alloc * sizeof(struct ws_task));
+			if (!tasks) {
+				pthread_mutex_unlock(&w->lock);
+				return 0;
+			}
+			w->tasks = tasks;
+			w->alloc = alloc;
+		}
+	}
+	w->tasks[w->tail].fn = fn;
+	w->tasks[w->tail].arg = arg;
+	w->tail++;
+	pthread_mutex_unlock(&w->lock);
+	return 1;
+}
+
+static int ws_pop(struct ws_worker *w, struct ws_task *task)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail > w->head) {
+		*task = w->tasks[--w->tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+static int ws_steal(struct ws_worker *w, struct ws_task *task)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail > w->head) {
+		*task = w->tasks[w->head++];
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+static void *ws_worker_loop(void *arg)
+{
+	struct ws_worker *w = arg;
+	struct ws_pool *pool = w->pool;
+	struct ws_task task;
+	int i;
+
+	ws_self = w;
+	for (;;) {
+		int found = ws_pop(w, &task);
+
+		/* [SYN] Own deque empty, go look for work elsewhere */
+		for (i = 1; !found && i < pool->count; i++) {
+			found = ws_steal(&pool->workers[(w->id + i) % pool->count], &task);
+		}
+		if (!found) {
+			if (__sync_add_and_fetch(&pool->pending, 0) == 0) {
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+		task.fn(pool, task.arg);
+		__sync_sub_and_fetch(&pool->pending, 1);
+	}
+	ws_self = NULL;
+	return NULL;
+}
+
+/* [SYN] Queue a task, to be called from within a running task. If it can't be
+ * queued, it is run right away. */
+void ws_spawn(struct ws_pool *pool, ws_func fn, void *arg)
+{
+	struct ws_worker *w = ws_self ? ws_self : &pool->workers[0];
+
+	__sync_add_and_fetch(&pool->pending, 1);
+	if (!ws_push(w, fn, arg)) {
+		fn(pool, arg);
+		__sync_sub_and_fetch(&pool->pending, 1);
+	}
+}
+
+/* [SYN] Index of the worker running the current task */
+int ws_worker_id(void)
+{
+	return ws_self ? ws_self->id : 0;
+}
+
+/* [SYN] Run fn(arg) and everything it spawns on threads workers. The calling
+ * thread is worker 0. Returns 0 if the pool couldn't be set up. */
+int ws_run(int threads, ws_func fn, void *arg)
+{
+	struct ws_pool pool;
+	pthread_t *tids;
+	int started, i;
+
+	if (threads < 1) {
+		threads = 1;
+	}
+	memset(&pool, 0, sizeof(pool));
+	pool.count = threads;
+	pool.workers = calloc(threads, sizeof(struct ws_worker));
+	tids = calloc(threads, sizeof(pthread_t));
+	if (!pool.workers || !tids) {
+		free(pool.workers);
+		free(tids);
+		return 0;
+	}
+	for (i = 0; i < threads; i++) {
+		pool.workers[i].pool = &pool;
+		pool.workers[i].id = i;
+		pthread_mutex_init(&pool.workers[i].lock, NULL);
+	}
+
+	pool.pending = 1;
+	if (!ws_push(&pool.workers[0], fn, arg)) {
+		free(pool.workers);
+		free(tids);
+		return 0;
+	}
+
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(&tids[started], NULL, ws_worker_loop,
+					&pool.workers[started]) != 0) {
+			break;
+		}
+	}
+	ws_worker_loop(&pool.workers[0]);
+	for (i = 1; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_destroy(&pool.workers[i].lock);
+		free(pool.workers[i].tasks);
+	}
+	free(pool.workers);
+	free(tids);
+	return 1;
+}
@@ -0,0 +1,203 @@
+/*
+ * recover.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains --recover. Without it, a broken hbin header ends the
+ * check after pass 2, as there is no telling where the next hbin starts.
+ * With it, the hbin list carries on at the next page with a good hbin
+ * header, and what lies in between is searched for cells: anything on an 8
+ * byte boundary that has a used cell size fitting in the gap, followed by
+ * a record signature. Pass 2 does the same for the rest of an hbin after a
+ * broken cell. Passes 3 to 5 then run over what was found.
+ *
+ * The search looks at the top byte of the cell sizes first, 16 or 32 bytes
+ * at a time with SSE2 or AVX2 where the CPU has them, and only checks the
+ * few cells where it is 0xFF, so it keeps up with reading the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1
+#endif
+
+/* [SYN] Record cells stay well below this, even lists of 65535 keys and
+ * sk records. A bogus size in garbage would otherwise skip what follows. */
+#define RECOVER_CELL_MAX 0x100000
+
+/* [SYN] A used cell with a known record that fits in len bytes */
+static int cell_plausible(const uint8_t *data, uint64_t len)
+{
+	int32_t size;
+
+	if (len < 8) {
+		return 0;
+	}
+	memcpy(&size, data, 4);
+	if (size >= -8 || size < -RECOVER_CELL_MAX || size % 8 != 0 ||
+			(uint64_t)-size > len) {
+		return 0;
+	}
+	return record_kind(data + 4) != RECORD_UNKNOWN;
+}
+
+/* [SYN] Offset of the first plausible cell in data, len if there is none */
+static uint64_t scan_scalar(const uint8_t *data, uint64_t len)
+{
+	uint64_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		if (cell_plausible(data + i, len - i)) {
+			return i;
+		}
+	}
+	return len;
+}
+
+#ifdef __SSE2__
+/* [SYN] Two cells per load. The size of a used cell is a small negative
+ * number, its top byte is 0xFF; only there the rest is looked at. */
+static uint64_t scan_sse2(const uint8_t *data, uint64_t len)
+{
+	const __m128i ff = _mm_set1_epi8((char)0xFF);
+	uint64_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		unsigned int bits = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, ff)) & 0x0808;
+
+		while (bits) {
+			uint64_t j = i + (__builtin_ctz(bits) & ~7);
+
+			if (cell_plausible(data + j, len - j)) {
+				return j;
+			}
+			bits &= bits - 1;
+		}
+	}
+	return i + scan_scalar(data + i, len - i);
+}
+#endif
+
+#ifdef HAVE_AVX2_SCAN
+/* [SYN] Four cells per load */
+__attribute__((target("avx2")))
+static uint64_t scan_avx2(const uint8_t *data, uint64_t len)
+{
+	const __m256i ff = _mm256_set1_epi8((char)0xFF);
+	uint64_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		unsigned int bits = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ff)) & 0x08080808;
+
+		while (bits) {
+			uint64_t j = i + (__builtin_ctz(bits) & ~7);
+
+			if (cell_plausible(data + j, len - j)) {
+				return j;
+			}
+			bits &= bits - 1;
+		}
+	}
+	return i + scan_scalar(data + i, len - i);
+}
+#endif
+
+static uint64_t scan_cells(const uint8_t *data, uint64_t len)
+{
+#ifdef HAVE_AVX2_SCAN
+	if (__builtin_cpu_supports("avx2")) {
+		return scan_avx2(data, len);
+	}
+#endif
+#ifdef __SSE2__
+	return scan_sse2(data, len);
+#else
+	return scan_scalar(data, len);
+#endif
+}
+
+/* [SYN] Offset of the first plausible cell from offset on, end if there is
+ * none before it. */
+hive_off_t recover_next_cell(struct hive *hive, hive_off_t offset, hive_off_t end)
+{
+	uint8_t *view;
+
+	offset = hive_off_add(offset, 7) & ~(hive_off_t)7;
+	if (offset < 0 || offset >= end) {
+		return end;
+	}
+	if (!(view = hive_view(hive, 0x1000 + offset, end - offset))) {
+		return end;
+	}
+	return offset + scan_cells(view, end - offset);
+}
+
+/* [SYN] Like get_hbin_header(), without the report */
+static int hbin_header_ok(struct hive *hive, hive_off_t offset)
+{
+	struct hbin_block hbin;
+	uint8_t *view;
+
+	if (!(view = hive_view(hive, offset + 0x1000, sizeof(hbin)))) {
+		return 0;
+	}
+	memcpy(&hbin, view, sizeof(hbin));
+	return hbin.id == 0x6E696268 && hbin.offset_from_first == offset &&
+		hbin.offset_to_next != 0 && hbin.offset_to_next % 0x1000 == 0 &&
+		hbin.offset_to_next <= hive->regf.data_size - offset;
+}
+
+/* [SYN] The hbin header at offset is broken. Take everything up to the next
+ * page with a good hbin header as one hbin, to be searched for cells. */
+void recover_hbin(struct hive *hive, hive_off_t offset, struct hbin_entry *hbin)
+{
+	hive_off_t next;
+
+	for (next = offset + 0x1000; next < hive->regf.data_size; next += 0x1000) {
+		if (hbin_header_ok(hive, next)) {
+			break;
+		}
+	}
+	hbin->offset = offset;
+	hbin->size = next - offset;
+	hbin->recovered = 1;
+}
+
+void recover_summary(struct hive *hive, struct hbin_list *list)
+{
+	uint64_t bytes = 0;
+	uint32_t i, count = 0;
+
+	for (i = 0; i < list->count; i++) {
+		if (list->hbins[i].recovered) {
+			count++;
+			bytes += list->hbins[i].size;
+		}
+	}
+	if (count) {
+		report("Recovery: %lu hbins with 0x%llx bytes had a broken header, ",
+				(unsigned long)count, (unsigned long long)bytes);
+	} else {
+		report("Recovery: ");
+	}
+	report("%llu cells found by searching\n",
+			(unsigned long long)hive->recovered_cells);
+}
@@ -5,8 +5,8 @@ struct regf_block {
 	uint32_t id;			/* [SYN] 'regf' 0x66676572*/
 	uint32_t uk1[2];		/* [SYN] Same value twice */
 	uint32_t timestamp[2];		/* [SYN] NT timestamp */
-	uint32_t version[4];		/* [SYN] 0x1,0x3 or 0x5,0x0,0x1 */
-	int32_t key_offset;		/* [SYN] offset of 1st key */
+	uint32_t version[4];		/* [SYN] 0x1,0x3 or 0x5,type,0x1 */
+	uint32_t key_offset;		/* [SYN] offset of 1st key */
 	uint32_t data_size;		/* [SYN] size of data blocks */
 	uint32_t uk2;			/* [SYN] 0x1 */
 	uint8_t description[0x40]; 	/* [SYN] Unicode description */
@@ -14,10 +14,36 @@ struct regf_block {
 	uint32_t checksum;		/* [SYN] XOR checksum */
 };
 
+/* [SYN] File types in version[2]; logs start with a copy of the header */
+#define REGF_TYPE_PRIMARY	0
+#define REGF_TYPE_LOG		1	/* [SYN] dirty sector bitmap, up to Windows 8 */
+#define REGF_TYPE_LOG_ENTRIES	6	/* [SYN] log entries, Windows 8.1 and up */
+
+/* [SYN] After the header of a type 1 log, at 0x200: 'DIRT', then a bit per
+ * 0x200 bytes of hbin data. The dirty sectors follow, from the next 0x200. */
+#define LOG_DIRTY_ID		0x54524944	/* [SYN] 'DIRT' */
+
+/* [SYN] Entries of a type 6 log follow each other from 0x200 on. Each is
+ * followed by dirty_count dirty page references, then the pages. */
+struct log_entry {
+	uint32_t id;			/* [SYN] 'HvLE' 0x454C7648 */
+	uint32_t size;			/* [SYN] size of the entry, multiple of 0x200 */
+	uint32_t flags;
+	uint32_t sequence;		/* [SYN] one more than the previous entry */
+	uint32_t data_size;		/* [SYN] size of data blocks after it */
+	uint32_t dirty_count;		/* [SYN] number of dirty pages */
+	uint64_t hash1;			/* [SYN] Marvin32 of what follows the header */
+	uint64_t hash2;			/* [SYN] Marvin32 of the first 0x20 bytes */
+};
+struct log_dirty_page {
+	uint32_t offset;		/* [SYN] offset from 0x1000 */
+	uint32_t size;			/* [SYN] multiple of 0x1000 */
+};
+
 struct hbin_block {
 	uint32_t id;			/* [SYN] 'hbin' 0x6E696368 */
-	int32_t offset_from_first;	/* [SYN] offset from 0x1000 */
-	int32_t offset_to_next;		/* [SYN] offset to next hbin */
+	uint32_t offset_from_first;	/* [SYN] offset from 0x1000 */
+	uint32_t offset_to_next;	/* [SYN] offset to next hbin */
 	uint32_t uk1[2];		/* [SYN] ?? */
 	uint32_t timestamp[2];		/* [SYN] NT timestamp */
 	uint32_t size;			/* [SYN] size of hbin block */
@@ -27,20 +53,23 @@ struct hbin_data_block {
 	uint8_t *data;			/* [SYN] the record data */
 };
 
+/* [SYN] nk type bit: the key name is stored as Latin-1, not UTF-16 */
+#define NK_COMPRESSED_NAME	0x20
+
 struct nk_record {
 	uint16_t id;			/* [SYN] 'nk' 0x6B6E */
 	uint16_t type;			/* [SYN] root,link,normal */
 	uint32_t timestamp[2];		/* [SYN] NT timestamp */
 	uint32_t uk1;			/* [SYN] ?? 0 */
-	int32_t parent_offset;		/* [SYN] Parent nk key */
+	uint32_t parent_offset;		/* [SYN] Parent nk key */
 	uint32_t subkey_count;		/* [SYN] number of subkeys */
 	uint32_t uk2;			/* [SYN] ?? 0 */
 	uint32_t subkey_offset;		/* [SYN] offset of lh/lf/li/ri */
 	int32_t uk3;			/* [SYN] ?? 0 or -1 */
 	uint32_t value_count;		/* [SYN] number of values */
-	int32_t value_offset;		/* [SYN] value list offset */
-	int32_t sk_offset;		/* [SYN] Security key offset */
-	int32_t classname_offset;	/* [SYN] offset of class name? */
+	uint32_t value_offset;		/* [SYN] value list offset */
+	uint32_t sk_offset;		/* [SYN] Security key offset */
+	uint32_t classname_offset;	/* [SYN] offset of class name? */
 	uint32_t uk4[5];		/* [SYN] ?? */
 	uint16_t keyname_length;	/* [SYN] Key name length */
 	uint16_t classname_length;	/* [SYN] Class name length */
@@ -53,7 +82,7 @@ struct lh_record {
 	uint8_t data;
 };
 struct lh_record_data {
-	int32_t offset;			/* [SYN] offset of the key */
+	uint32_t offset;		/* [SYN] offset of the key */
 	uint32_t hash;			/* [SYN] base37 hash 4 bytes */
 };
 struct lf_record {
@@ -62,7 +91,7 @@ struct lf_record {
 	uint8_t data;
 };
 struct lf_record_data {
-	int32_t offset;			/* [SYN] offset of the key */
+	uint32_t offset;		/* [SYN] offset of the key */
 	char name[4];			/* [SYN] 4 bytes of key name */
 };
 struct li_record {
@@ -71,7 +100,7 @@ struct li_record {
 	uint8_t data;
 };
 struct li_record_data {
-	int32_t offset;			/* [SYN] offset of the key */
+	uint32_t offset;		/* [SYN] offset of the key */
 };
 struct ri_record {
 	uint16_t id;			/* [SYN] 'ri' 0x6972 */
@@ -79,13 +108,22 @@ struct ri_record {
 	uint8_t data;
 };
 struct ri_record_data {
-	int32_t offset;			/* [SYN] offsets of li/lh */
+	uint32_t offset;		/* [SYN] offsets of li/lh */
 };
+/* [SYN] Big data, for values over DB_SEGMENT_SIZE bytes in 1.4+ hives. The
+ * data is spread over the cells in the segment list. */
+struct db_record {
+	uint16_t id;			/* [SYN] 'db' 0x6264 */
+	uint16_t segment_count;		/* [SYN] number of data segments */
+	uint32_t segment_offset;	/* [SYN] offset of the segment list */
+};
+#define DB_SEGMENT_SIZE		16344	/* [SYN] data bytes per segment */
+
 struct vk_record {
 	uint16_t id;			/* [SYN] 'vk' 0x6B76 */
 	uint16_t name_length;		/* [SYN] value name length */
 	uint32_t data_length;		/* [SYN] length of data */
-	int32_t data_offset;		/* [SYN] data offset or data */
+	uint32_t data_offset;		/* [SYN] data offset or data */
 	uint32_t type;			/* [SYN] data type */
 	uint16_t flag;			/* [SYN] flags */
 	uint16_t unused1;		/* [SYN] unused, data trash */
@@ -108,8 +146,8 @@ struct vk_record {
 struct sk_record {
 	uint16_t id;			/* [SYN] 'sk' 0x6B73 */
 	uint16_t unused1;		/* [SYN] unused, 0x00? */
-	int32_t prev_sk_offset;	/* [SYN] previous sk record */
-	int32_t next_sk_offset;	/* [SYN] next sk record */
+	uint32_t prev_sk_offset;	/* [SYN] previous sk record */
+	uint32_t next_sk_offset;	/* [SYN] next sk record */
 	uint32_t usage_counter;	/* [SYN] Usage counter */
 	uint32_t size;		/* [SYN] sk data size */
 	uint8_t data;
@@ -0,0 +1,553 @@
+/*
+ * report.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the reporting functions. Findings go to stdout, unless
+ * the current thread has a buffer set; worker threads collect their output
+ * that way, so it can be printed in file order afterwards.
+ *
+ * Findings are reported with diag(), which knows their code, severity, cell
+ * and record kind. They come out as the usual text, or as JSON Lines; in the
+ * latter case plain report() text is left out, so every line parses. The
+ * library has them collected as struct chkregf_finding instead, in the same
+ * order, and nothing is written at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+static __thread struct report_buf *report_target;
+static enum report_format report_format;
+/* [SYN] Borrowed by worker threads from the thread that started them */
+static __thread struct report_scope *report_scope;
+
+static const char *severity_names[] = {
+	[DIAG_DEBUG] = "debug",
+	[DIAG_WARNING] = "warning",
+	[DIAG_ERROR] = "error",
+};
+
+/* [SYN] The prefix keeps the text output as it always was */
+static const struct diag_info {
+	const char *name;
+	enum diag_severity severity;
+	const char *prefix;
+} diag_info[DIAG_CODES] = {
+	[DIAG_NOMEM] =			{ "nomem", DIAG_ERROR, "" },
+	[DIAG_OPEN] =			{ "open", DIAG_ERROR, "Error: " },
+	[DIAG_THREADS] =		{ "threads", DIAG_ERROR, "" },
+	[DIAG_REGF_READ] =		{ "regf-read", DIAG_ERROR, "Error: " },
+	[DIAG_REGF_SIGNATURE] =		{ "regf-signature", DIAG_ERROR, "" },
+	[DIAG_REGF_SEQUENCE] =		{ "regf-sequence", DIAG_ERROR, "" },
+	[DIAG_REGF_VERSION] =		{ "regf-version", DIAG_ERROR, "" },
+	[DIAG_REGF_KEY_OFFSET] =	{ "regf-key-offset", DIAG_ERROR, "Error: " },
+	[DIAG_REGF_KEY_OFFSET_LARGE] =	{ "regf-key-offset-large", DIAG_WARNING, "Warning: " },
+	[DIAG_REGF_DATA_SIZE] =		{ "regf-data-size", DIAG_ERROR, "Error: " },
+	[DIAG_REGF_DATA_SIZE_LARGE] =	{ "regf-data-size-large", DIAG_WARNING, "Warning: " },
+	[DIAG_REGF_DESCRIPTION] =	{ "regf-description", DIAG_WARNING, "Warning: " },
+	[DIAG_REGF_CHECKSUM] =		{ "regf-checksum", DIAG_ERROR, "Error: " },
+	[DIAG_LOG_READ] =		{ "log-read", DIAG_WARNING, "Warning: " },
+	[DIAG_LOG_HEADER] =		{ "log-header", DIAG_WARNING, "Warning: " },
+	[DIAG_LOG_ENTRY] =		{ "log-entry", DIAG_WARNING, "Warning: " },
+	[DIAG_HBIN_READ] =		{ "hbin-read", DIAG_ERROR, "Error: " },
+	[DIAG_HBIN_SIGNATURE] =		{ "hbin-signature", DIAG_ERROR, "Error: " },
+	[DIAG_HBIN_OFFSET] =		{ "hbin-offset", DIAG_ERROR, "Error: " },
+	[DIAG_HBIN_NEXT] =		{ "hbin-next", DIAG_ERROR, "Error: " },
+	[DIAG_HBIN_HEADER] =		{ "hbin-header", DIAG_ERROR, "" },
+	[DIAG_CELL_READ] =		{ "cell-read", DIAG_ERROR, "Error: " },
+	[DIAG_CELL_SIZE_ZERO] =		{ "cell-size-zero", DIAG_ERROR, "Error: " },
+	[DIAG_CELL_ORDER] =		{ "cell-order", DIAG_ERROR, "Error: " },
+	[DIAG_CELL_OFFSET] =		{ "cell-offset", DIAG_ERROR, "Error: " },
+	[DIAG_CELL_INSIDE] =		{ "cell-inside", DIAG_ERROR, "Error: " },
+	[DIAG_CELL_UNUSED] =		{ "cell-unused", DIAG_ERROR, "Error: " },
+	[DIAG_CELL_UNEXPECTED] =	{ "cell-unexpected", DIAG_ERROR, "Error: " },
+	[DIAG_CELL_UNKNOWN] =		{ "cell-unknown", DIAG_ERROR, "" },
+	[DIAG_CELL_TOO_SMALL] =		{ "cell-too-small", DIAG_ERROR, "Error: " },
+	[DIAG_CELL_HBIN_END] =		{ "cell-hbin-end", DIAG_ERROR, "Error: " },
+	[DIAG_SK_SELF] =		{ "sk-self", DIAG_ERROR, "Error: " },
+	[DIAG_SK_LINK] =		{ "sk-link", DIAG_ERROR, "Error: " },
+	[DIAG_SK_SIZE] =		{ "sk-size", DIAG_ERROR, "Error: " },
+	[DIAG_SK_DROPPED] =		{ "sk-dropped", DIAG_WARNING, "Warning: " },
+	[DIAG_SK_NEXT] =		{ "sk-next", DIAG_ERROR, "Error: " },
+	[DIAG_SK_PREV] =		{ "sk-prev", DIAG_ERROR, "Error: " },
+	[DIAG_SK_LOOP] =		{ "sk-loop", DIAG_ERROR, "Error: " },
+	[DIAG_SK_UNLINKED] =		{ "sk-unlinked", DIAG_ERROR, "Error: " },
+	[DIAG_SK_USAGE] =		{ "sk-usage", DIAG_ERROR, "Error: " },
+	[DIAG_VK_NAME_LENGTH] =		{ "vk-name-length", DIAG_ERROR, "Error: " },
+	[DIAG_VK_DATA_OFFSET] =		{ "vk-data-offset", DIAG_ERROR, "Error: " },
+	[DIAG_VK_REG_NONE] =		{ "vk-reg-none", DIAG_WARNING, "Warning: " },
+	[DIAG_VK_TYPE] =		{ "vk-type", DIAG_WARNING, "Warning: " },
+	[DIAG_VK_FLAG] =		{ "vk-flag", DIAG_DEBUG, "DEBUG: " },
+	[DIAG_LIST_SIZE] =		{ "list-size", DIAG_ERROR, "" },
+	[DIAG_LIST_EMPTY] =		{ "list-empty", DIAG_ERROR, "" },
+	[DIAG_LIST_OFFSET] =		{ "list-offset", DIAG_ERROR, "" },
+	[DIAG_LIST_COUNT] =		{ "list-count", DIAG_ERROR, "Error: " },
+	[DIAG_LIST_SORT] =		{ "list-sort", DIAG_ERROR, "Error: " },
+	[DIAG_LF_HINT] =		{ "lf-hint", DIAG_ERROR, "Error: " },
+	[DIAG_LH_HASH] =		{ "lh-hash", DIAG_ERROR, "Error: " },
+	[DIAG_LH_VERSION] =		{ "lh-version", DIAG_WARNING, "" },
+	[DIAG_NK_NAME_LENGTH] =		{ "nk-name-length", DIAG_ERROR, "Error: " },
+	[DIAG_NK_TYPE] =		{ "nk-type", DIAG_WARNING, "Warning: " },
+	[DIAG_NK_ROOT] =		{ "nk-root", DIAG_ERROR, "Error: " },
+	[DIAG_NK_NO_PARENT] =		{ "nk-no-parent", DIAG_ERROR, "Error: " },
+	[DIAG_NK_PARENT] =		{ "nk-parent", DIAG_ERROR, "Error: " },
+	[DIAG_NK_SUBKEY_LIST] =		{ "nk-subkey-list", DIAG_ERROR, "Error: " },
+	[DIAG_NK_ZERO_OFFSET] =		{ "nk-zero-offset", DIAG_ERROR, "Error: " },
+	[DIAG_NK_CLASS_NAME] =		{ "nk-class-name", DIAG_ERROR, "Error: " },
+	[DIAG_NK_VALUE_LIST] =		{ "nk-value-list", DIAG_ERROR, "Error: " },
+	[DIAG_NK_NO_SK] =		{ "nk-no-sk", DIAG_ERROR, "Error: " },
+	[DIAG_NK_UNKNOWN] =		{ "nk-unknown", DIAG_DEBUG, "DEBUG: " },
+	[DIAG_DB_SEGMENTS] =		{ "db-segments", DIAG_ERROR, "Error: " },
+	[DIAG_DB_LIST_OFFSET] =		{ "db-list-offset", DIAG_ERROR, "Error: " },
+	[DIAG_DB_COUNT] =		{ "db-count", DIAG_ERROR, "Error: " },
+	[DIAG_ORPHAN] =			{ "orphan", DIAG_WARNING, "Warning: " },
+	[DIAG_ORPHAN_TOTAL] =		{ "orphan-total", DIAG_WARNING, "Warning: " },
+};
+
+static const char *record_kind_names[RECORD_KINDS] = {
+	[RECORD_UNKNOWN] = "other",
+	[RECORD_NK] = "nk",
+	[RECORD_SK] = "sk",
+	[RECORD_VK] = "vk",
+	[RECORD_LF] = "lf",
+	[RECORD_LH] = "lh",
+	[RECORD_LI] = "li",
+	[RECORD_RI] = "ri",
+	[RECORD_DB] = "db",
+};
+
+const char *record_kind_name(enum record_kind kind)
+{
+	return record_kind_names[kind];
+}
+
+struct report_buf *report_buf_new(TALLOC_CTX *mem_ctx)
+{
+	return talloc_zero(mem_ctx, struct report_buf);
+}
+
+/* [SYN] A buffer that lives in, and grows from, an arena */
+struct report_buf *report_buf_arena(struct arena *arena)
+{
+	struct report_buf *buf = arena_alloc(arena, sizeof(struct report_buf));
+
+	if (buf) {
+		buf->arena = arena;
+	}
+	return buf;
+}
+
+struct report_buf *report_set_buffer(struct report_buf *buf)
+{
+	struct report_buf *old = report_target;
+
+	report_target = buf;
+	return old;
+}
+
+/* [SYN] Make room for len more bytes (plus a NUL) in buf */
+static int report_grow(struct report_buf *buf, size_t len)
+{
+	size_t alloc = buf->alloc ? buf->alloc : 256;
+	char *data;
+
+	if (buf->len + len + 1 <= buf->alloc) {
+		return 1;
+	}
+	while (alloc < buf->len + len + 1) {
+		alloc *= 2;
+	}
+	if (buf->arena) {
+		/* [SYN] Arenas can't grow in place, the old data stays behind */
+		data = arena_alloc(buf->arena, alloc);
+		if (data && buf->len) {
+			memcpy(data, buf->data, buf->len + 1);
+		}
+	} else {
+		data = talloc_realloc(buf, buf->data, char, alloc);
+	}
+	if (!data) {
+		return 0;
+	}
+	buf->data = data;
+	buf->alloc = alloc;
+	return 1;
+}
+
+/* [SYN] len bytes of buf's own, from where it grows */
+static char *report_alloc(struct report_buf *buf, size_t len)
+{
+	if (buf->arena) {
+		return arena_alloc(buf->arena, len);
+	}
+	return talloc_size(buf, len);
+}
+
+/* [SYN] Add a copy of finding, with a copy of its message, to buf */
+static int report_add_finding(struct report_buf *buf,
+		const struct chkregf_finding *finding)
+{
+	struct chkregf_finding *findings = buf->findings;
+	size_t len = strlen(finding->message);
+	char *message;
+
+	if (buf->count == buf->findings_alloc) {
+		uint32_t alloc = buf->findings_alloc ? buf->findings_alloc * 2 : 16;
+
+		if (buf->arena) {
+			findings = arena_alloc(buf->arena, alloc * sizeof(*findings));
+			if (findings && buf->count) {
+				memcpy(findings, buf->findings, buf->count * sizeof(*findings));
+			}
+		} else {
+			findings = talloc_realloc(buf, buf->findings, struct chkregf_finding, alloc);
+		}
+		if (!findings) {
+			return 0;
+		}
+		buf->findings = findings;
+		buf->findings_alloc = alloc;
+	}
+	if (!(message = report_alloc(buf, len + 1))) {
+		return 0;
+	}
+	memcpy(message, finding->message, len + 1);
+	findings[buf->count] = *finding;
+	findings[buf->count].message = message;
+	buf->count++;
+	return 1;
+}
+
+static void report_va(const char *fmt, va_list ap)
+{
+	struct report_buf *buf = report_target;
+	va_list copy;
+	int len;
+
+	if (!buf) {
+		vprintf(fmt, ap);
+		return;
+	}
+
+	va_copy(copy, ap);
+	len = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+	if (len <= 0) {
+		return;
+	}
+	if (!report_grow(buf, len)) {
+		buf->lost = 1;
+		return;
+	}
+
+	vsnprintf(buf->data + buf->len, len + 1, fmt, ap);
+	buf->len += len;
+}
+
+/* [SYN] Plain text, left out of JSON output */
+void report(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (report_get_format() != REPORT_HUMAN) {
+		return;
+	}
+	va_start(ap, fmt);
+	report_va(fmt, ap);
+	va_end(ap);
+}
+
+/* [SYN] Output that goes out whatever the format */
+void report_raw(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	report_va(fmt, ap);
+	va_end(ap);
+}
+
+/* [SYN] Escape src as a JSON string, quotes included. Returns a malloc'ed
+ * string, the caller frees it. */
+static char *json_string(const char *src, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *out, *p;
+	size_t i;
+
+	if (!(out = malloc(len * 6 + 3))) {
+		return NULL;
+	}
+	p = out;
+	*p++ = '"';
+	for (i = 0; i < len; i++) {
+		unsigned char c = src[i];
+
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20 || c >= 0x7F) {
+			/* [SYN] Not necessarily UTF-8, so every high byte is escaped too */
+			*p++ = '\\';
+			*p++ = 'u';
+			*p++ = '0';
+			*p++ = '0';
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 0xF];
+		} else {
+			*p++ = c;
+		}
+	}
+	*p++ = '"';
+	*p = '\0';
+	return out;
+}
+
+/* [SYN] The format of threads without a scope of their own */
+void report_set_format(enum report_format format)
+{
+	report_format = format;
+}
+
+enum report_format report_get_format(void)
+{
+	return report_scope ? report_scope->format : report_format;
+}
+
+/* [SYN] A scope for the findings of one hive, path NULL if it has no name */
+struct report_scope *report_scope_new(TALLOC_CTX *mem_ctx, const char *path,
+		enum report_format format)
+{
+	struct report_scope *scope = talloc_zero(mem_ctx, struct report_scope);
+	char *file;
+
+	if (!scope) {
+		return NULL;
+	}
+	scope->format = format;
+	if (path) {
+		file = json_string(path, strlen(path));
+		scope->file = file ? talloc_strdup(scope, file) : NULL;
+		free(file);
+		if (!scope->file) {
+			talloc_free(scope);
+			return NULL;
+		}
+	}
+	return scope;
+}
+
+struct report_scope *report_get_scope(void)
+{
+	return report_scope;
+}
+
+/* [SYN] Report in scope from now on, returns the one used so far. Worker
+ * threads use report_get_scope() of the thread that started them. */
+struct report_scope *report_use_scope(struct report_scope *scope)
+{
+	struct report_scope *old = report_scope;
+
+	report_scope = scope;
+	return old;
+}
+
+/* [SYN] Findings in the scope of this thread so far */
+uint64_t report_findings(void)
+{
+	return report_scope ? __atomic_load_n(&report_scope->findings, __ATOMIC_RELAXED) : 0;
+}
+
+const char *diag_name(enum diag_code code)
+{
+	return diag_info[code].name;
+}
+
+const char *diag_severity_name(enum diag_code code)
+{
+	return severity_names[diag_info[code].severity];
+}
+
+static void json_offset(char *buf, size_t size, hive_off_t offset)
+{
+	if (offset <= 0) {
+		snprintf(buf, size, "null");
+	} else {
+		snprintf(buf, size, "%lld", (long long)offset);
+	}
+}
+
+/* [SYN] A finding as struct chkregf_finding, message and all, for the
+ * buffer of this thread */
+static void diag_finding(enum diag_code code, hive_off_t offset, hive_off_t parent_off,
+		enum record_kind kind, const char *fmt, va_list ap)
+{
+	struct report_buf *buf = report_target;
+	struct chkregf_finding finding;
+	char *message;
+	va_list copy;
+	int len;
+
+	if (!buf) {
+		return;
+	}
+	va_copy(copy, ap);
+	len = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+	if (len < 0) {
+		return;
+	}
+	if (!(message = malloc(len + 1))) {
+		buf->lost = 1;
+		return;
+	}
+	vsnprintf(message, len + 1, fmt, ap);
+	while (len > 0 && (message[len-1] == '\n' || message[len-1] == ' ')) {
+		message[--len] = '\0';
+	}
+
+	finding.code = diag_info[code].name;
+	finding.severity = severity_names[diag_info[code].severity];
+	finding.kind = kind == RECORD_UNKNOWN ? NULL : record_kind_names[kind];
+	finding.offset = offset > 0 ? offset : 0;
+	finding.parent = parent_off > 0 ? parent_off : 0;
+	finding.message = message;
+	if (!report_add_finding(buf, &finding)) {
+		buf->lost = 1;
+	}
+	free(message);
+}
+
+/* [SYN] Report a finding. Offsets are as displayed (0 or less if unknown),
+ * fmt is the text without the prefix the table gives it. */
+void diag(enum diag_code code, hive_off_t offset, hive_off_t parent_off,
+		enum record_kind kind, const char *fmt, ...)
+{
+	const struct diag_info *info = &diag_info[code];
+	enum report_format format = report_get_format();
+	const char *file = report_scope ? report_scope->file : NULL;
+	char text[512], off[24], parent[24];
+	char *message;
+	va_list ap;
+	int len;
+
+	if (report_scope) {
+		__atomic_add_fetch(&report_scope->findings, 1, __ATOMIC_RELAXED);
+	}
+	parent_off = cell_file_off(parent_off);
+	if (format == REPORT_HUMAN) {
+		report_raw("%s", info->prefix);
+		va_start(ap, fmt);
+		report_va(fmt, ap);
+		va_end(ap);
+		return;
+	}
+	if (format == REPORT_FINDINGS) {
+		va_start(ap, fmt);
+		diag_finding(code, offset, parent_off, kind, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	va_start(ap, fmt);
+	len = vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		return;
+	}
+	if (len >= sizeof(text)) {
+		len = sizeof(text) - 1;
+	}
+	while (len > 0 && (text[len-1] == '\n' || text[len-1] == ' ')) {
+		len--;
+	}
+	if (!(message = json_string(text, len))) {
+		return;
+	}
+	json_offset(off, sizeof(off), offset);
+	json_offset(parent, sizeof(parent), parent_off);
+	report_raw("{\"file\": %s, \"code\": \"%s\", \"severity\": \"%s\", "
+			"\"offset\": %s, \"parent\": %s, \"kind\": %s%s%s, \"message\": %s}\n",
+			file ? file : "null", info->name,
+			severity_names[info->severity], off, parent,
+			kind == RECORD_UNKNOWN ? "" : "\"",
+			kind == RECORD_UNKNOWN ? "null" : record_kind_names[kind],
+			kind == RECORD_UNKNOWN ? "" : "\"", message);
+	free(message);
+}
+
+/* [SYN] The outcome of checking a hive, as the last JSON line of it */
+void report_status(const char *path, const char *status, uint32_t cells)
+{
+	char *file = json_string(path, strlen(path));
+
+	report_raw("{\"file\": %s, \"status\": \"%s\", \"cells\": %lu}\n",
+			file ? file : "null", status, (unsigned long)cells);
+	free(file);
+}
+
+/* [SYN] Pass part of the collected output on to whatever this thread
+ * reports to: the text from text_pos to text_end, and the findings from
+ * first to last. Only the command line has nothing to report to, it gets
+ * stdout. */
+void report_flush_part(struct report_buf *buf, size_t text_pos, size_t text_end,
+		uint32_t first, uint32_t last)
+{
+	struct report_buf *target = report_target;
+	size_t len = text_end - text_pos;
+	uint32_t i;
+
+	if (target == buf) {
+		return;
+	}
+	if (!target) {
+		if (len) {
+			fwrite(buf->data + text_pos, 1, len, stdout);
+		}
+		if (buf->lost) {
+			buf->lost = 0;
+			diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+					"Memory allocation error, output was lost\n");
+		}
+		return;
+	}
+	if (len && report_grow(target, len)) {
+		memcpy(target->data + target->len, buf->data + text_pos, len);
+		target->len += len;
+		target->data[target->len] = '\0';
+	} else if (len) {
+		target->lost = 1;
+	}
+	for (i = first; i < last; i++) {
+		if (!report_add_finding(target, &buf->findings[i])) {
+			target->lost = 1;
+			break;
+		}
+	}
+	target->lost |= buf->lost;
+}
+
+/* [SYN] Pass all of the collected output on, and empty buf */
+void report_flush(struct report_buf *buf)
+{
+	report_flush_part(buf, 0, buf->len, 0, buf->count);
+	buf->len = 0;
+	buf->count = 0;
+	buf->lost = 0;
+}
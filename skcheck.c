@@ -0,0 +1,255 @@
+/*
+ * skcheck.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the security key checks. Pass 2 puts every sk record
+ * in a hash table, pass 3 counts the keys that refer to each of them, and
+ * pass 5 walks the ring of sk records once and compares the counts with the
+ * usage counters.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+struct sk_entry {
+	uint32_t offset;		/* [SYN] 0 marks an empty slot */
+	uint32_t refs;			/* [SYN] keys seen referring to it */
+	uint32_t usage_counter;
+	uint32_t prev_sk_offset;
+	uint32_t next_sk_offset;
+	uint32_t in_ring;
+};
+
+struct sk_table {
+	struct sk_entry *slots;
+	uint32_t mask;			/* [SYN] slot count - 1 */
+	uint32_t count;
+	uint32_t limit;			/* [SYN] stop inserting here */
+	uint32_t dropped;		/* [SYN] sk records that didn't fit */
+};
+
+static uint32_t sk_hash(uint32_t offset)
+{
+	/* [SYN] Cells are 8 byte aligned, the low bits carry nothing */
+	return (offset >> 3) * 0x9E3779B1;
+}
+
+/* [SYN] Find or add the slot for offset. Safe to call from several workers,
+ * a slot is claimed with a compare and swap on its offset. */
+static struct sk_entry *sk_slot(struct sk_table *table, uint32_t offset, int add)
+{
+	uint32_t i = sk_hash(offset) & table->mask;
+
+	/* [SYN] 0 marks an empty slot, it's never an sk record */
+	if (offset == 0) {
+		return NULL;
+	}
+	for (;;) {
+		struct sk_entry *slot = &table->slots[i];
+		uint32_t cur = __atomic_load_n(&slot->offset, __ATOMIC_ACQUIRE);
+
+		if (cur == offset) {
+			return slot;
+		}
+		if (cur == 0) {
+			if (!add) {
+				return NULL;
+			}
+			if (__atomic_add_fetch(&table->count, 1, __ATOMIC_RELAXED) > table->limit) {
+				__atomic_sub_fetch(&table->count, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&table->dropped, 1, __ATOMIC_RELAXED);
+				return NULL;
+			}
+			if (__atomic_compare_exchange_n(&slot->offset, &cur, offset, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				return slot;
+			}
+			/* [SYN] Somebody else took it, look again */
+			__atomic_sub_fetch(&table->count, 1, __ATOMIC_RELAXED);
+			if (cur == offset) {
+				return slot;
+			}
+		}
+		i = (i + 1) & table->mask;
+	}
+}
+
+static void sk_fill(struct sk_entry *slot, struct sk_record *sk)
+{
+	slot->usage_counter = sk->usage_counter;
+	slot->prev_sk_offset = sk->prev_sk_offset;
+	slot->next_sk_offset = sk->next_sk_offset;
+}
+
+/* [SYN] Set up the table with the sk records pass 2 found */
+int sk_table_init(struct hive *hive)
+{
+	struct cell_index *index = hive->index;
+	struct sk_table *table;
+	uint32_t i, sks = 0, slots = 1024;
+
+	for (i = 0; i < index->count; i++) {
+		if (index->cells[i].allocated && index->cells[i].type == RECORD_SK) {
+			sks++;
+		}
+	}
+	/* [SYN] Room for the ones pass 3 finds outside of pass 2 as well */
+	while (slots < sks * 4) {
+		slots *= 2;
+	}
+
+	table = talloc_zero(hive, struct sk_table);
+	if (!table) {
+		return 0;
+	}
+	table->slots = talloc_zero_array(table, struct sk_entry, slots);
+	if (!table->slots) {
+		talloc_free(table);
+		return 0;
+	}
+	table->mask = slots - 1;
+	table->limit = slots - slots / 4;
+
+	for (i = 0; i < index->count; i++) {
+		struct cell_entry *cell = &index->cells[i];
+		struct sk_entry *slot;
+		uint8_t *view;
+
+		if (!cell->allocated || cell->type != RECORD_SK ||
+				cell->size < 4 + 0x14) {
+			continue;
+		}
+		view = hive_view(hive, (uint64_t)cell->offset + 0x1000 + 4, 0x14);
+		if (view && (slot = sk_slot(table, cell->offset, 1))) {
+			sk_fill(slot, (struct sk_record *)view);
+		}
+	}
+	hive->sk_table = table;
+	return 1;
+}
+
+/* [SYN] Pass 3 found a key referring to the sk record at offset */
+void sk_table_ref(struct hive *hive, uint32_t offset, struct hbin_data_block *block)
+{
+	struct sk_entry *slot;
+
+	if (!hive->sk_table) {
+		return;
+	}
+	slot = sk_slot(hive->sk_table, offset, 0);
+	if (!slot && block->size >= 4 + 0x14) {
+		/* [SYN] Not seen in pass 2, it's a valid cell all the same */
+		if ((slot = sk_slot(hive->sk_table, offset, 1))) {
+			sk_fill(slot, (struct sk_record *)block->data);
+		}
+	}
+	if (slot) {
+		__atomic_add_fetch(&slot->refs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int sk_compare(const void *a, const void *b)
+{
+	const struct sk_entry *x = a, *y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* [SYN] Pass 5: walk the sk ring once, then compare the usage counters */
+int check_sk(struct hive *hive)
+{
+	struct sk_table *table = hive->sk_table;
+	struct sk_entry *slot, *first = NULL;
+	uint32_t i, steps;
+	int error = 0;
+
+	if (!table || table->count == 0) {
+		return 1;
+	}
+	if (table->dropped) {
+		diag(DIAG_SK_DROPPED, 0, 0, RECORD_UNKNOWN,
+				"too many sk records, %lu were not checked\n",
+				(unsigned long)table->dropped);
+	}
+
+	/* [SYN] The ring can start anywhere, take the first one in the file */
+	for (i = 0; i <= table->mask; i++) {
+		slot = &table->slots[i];
+		if (slot->offset && (!first || slot->offset < first->offset)) {
+			first = slot;
+		}
+	}
+
+	slot = first;
+	for (steps = 0; steps <= table->count; steps++) {
+		struct sk_entry *next;
+
+		slot->in_ring = 1;
+		next = sk_slot(table, slot->next_sk_offset, 0);
+		if (!next) {
+			diag(DIAG_SK_NEXT, (long)slot->offset+0x1000, 0, RECORD_SK,
+					"Next sk offset (0x%lx) of sk record at 0x%lx is not an sk record\n",
+					(long)slot->next_sk_offset+0x1000, (long)slot->offset+0x1000);
+			error = 1;
+			break;
+		}
+		if (next->prev_sk_offset != slot->offset) {
+			diag(DIAG_SK_PREV, (long)next->offset+0x1000, 0, RECORD_SK,
+					"Previous sk offset (0x%lx) of sk record at 0x%lx should be 0x%lx\n",
+					(long)next->prev_sk_offset+0x1000, (long)next->offset+0x1000,
+					(long)slot->offset+0x1000);
+			error = 1;
+		}
+		if (next == first) {
+			break;
+		}
+		if (next->in_ring) {
+			diag(DIAG_SK_LOOP, (long)next->offset+0x1000, 0, RECORD_SK,
+					"sk list loops back to 0x%lx instead of 0x%lx\n",
+					(long)next->offset+0x1000, (long)first->offset+0x1000);
+			error = 1;
+			break;
+		}
+		slot = next;
+	}
+
+	/* [SYN] Report in file order, the table is done with after this */
+	qsort(table->slots, table->mask + 1, sizeof(struct sk_entry), sk_compare);
+	for (i = 0; i <= table->mask; i++) {
+		slot = &table->slots[i];
+		if (!slot->offset) {
+			continue;
+		}
+		if (!slot->in_ring) {
+			diag(DIAG_SK_UNLINKED, (long)slot->offset+0x1000, 0, RECORD_SK,
+					"sk record at 0x%lx is not in the sk list\n",
+					(long)slot->offset+0x1000);
+			error = 1;
+		}
+		if (slot->refs != slot->usage_counter) {
+			diag(DIAG_SK_USAGE, (long)slot->offset+0x1000, 0, RECORD_SK,
+					"sk record at 0x%lx has usage counter %lu, but %lu keys refer to it\n",
+					(long)slot->offset+0x1000, (unsigned long)slot->usage_counter,
+					(unsigned long)slot->refs);
+			error = 1;
+		}
+	}
+	talloc_free(table);
+	hive->sk_table = NULL;
+	return !error;
+}
@@ -0,0 +1,127 @@
+/*
+ * stats.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the --stats report: time per pass, cells per record
+ * kind, bytes looked at and memory used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+static double clock_secs(clockid_t id)
+{
+	struct timespec now;
+
+	clock_gettime(id, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void stats_start(struct hive *hive)
+{
+	hive->stats.wall_mark = clock_secs(CLOCK_MONOTONIC);
+	hive->stats.cpu_mark = clock_secs(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/* [SYN] Pass (1 to STAT_PASSES) is done, charge it the time since the last */
+void stats_lap(struct hive *hive, int pass)
+{
+	struct hive_stats *stats = &hive->stats;
+	double wall = clock_secs(CLOCK_MONOTONIC);
+	double cpu = clock_secs(CLOCK_PROCESS_CPUTIME_ID);
+
+	stats->wall[pass-1] += wall - stats->wall_mark;
+	stats->cpu[pass-1] += cpu - stats->cpu_mark;
+	stats->wall_mark = wall;
+	stats->cpu_mark = cpu;
+}
+
+void stats_report(struct hive *hive, int json)
+{
+	struct hive_stats *stats = &hive->stats;
+	struct rusage usage;
+	int i;
+
+	memset(&usage, 0, sizeof(usage));
+	getrusage(RUSAGE_SELF, &usage);
+
+	if (json) {
+		report_raw("{\"size\": %llu, \"passes\": [",
+				(unsigned long long)hive->regf.data_size + 0x1000);
+		for (i = 0; i < STAT_PASSES; i++) {
+			report_raw("%s{\"pass\": %d, \"wall\": %.6f, \"cpu\": %.6f}",
+					i ? ", " : "", i + 1, stats->wall[i], stats->cpu[i]);
+		}
+		report_raw("], \"cells\": {");
+		for (i = 0; i < RECORD_KINDS; i++) {
+			report_raw("\"%s\": %llu, ", record_kind_name(i),
+					(unsigned long long)stats->cells[i]);
+		}
+		report_raw("\"free\": %llu}, \"cell_bytes\": %llu, \"visits\": {",
+				(unsigned long long)stats->free_cells,
+				(unsigned long long)stats->cell_bytes);
+		for (i = 0; i < RECORD_KINDS; i++) {
+			report_raw("%s\"%s\": %llu", i ? ", " : "", record_kind_name(i),
+					(unsigned long long)stats->visits[i]);
+		}
+		report_raw("}, \"visit_bytes\": %llu, \"nk_fetches\": %llu, \"keys\": %llu, "
+				"\"reads\": %llu, \"read_bytes\": %llu, "
+				"\"page_faults\": %ld, \"major_faults\": %ld, "
+				"\"arena_allocs\": %llu, \"peak_rss_kb\": %ld}\n",
+				(unsigned long long)stats->visit_bytes,
+				(unsigned long long)hive->nk_fetches,
+				(unsigned long long)hive->nk_visits,
+				(unsigned long long)stats->reads,
+				(unsigned long long)stats->read_bytes,
+				usage.ru_minflt + usage.ru_majflt, usage.ru_majflt,
+				(unsigned long long)hive->arena_allocs,
+				usage.ru_maxrss);
+		return;
+	}
+
+	report("\nStatistics:\n");
+	report("  %-6s %12s %12s\n", "pass", "wall (s)", "cpu (s)");
+	for (i = 0; i < STAT_PASSES; i++) {
+		report("  %-6d %12.6f %12.6f\n", i + 1, stats->wall[i], stats->cpu[i]);
+	}
+	report("  %-8s %12s %12s\n", "kind", "pass 2", "pass 3");
+	for (i = 0; i < RECORD_KINDS; i++) {
+		if (!stats->cells[i] && !stats->visits[i]) {
+			continue;
+		}
+		report("  %-8s %12llu %12llu\n", record_kind_name(i),
+				(unsigned long long)stats->cells[i],
+				(unsigned long long)stats->visits[i]);
+	}
+	report("  %-8s %12llu\n", "free", (unsigned long long)stats->free_cells);
+	report("  bytes walked by pass 2: %llu, visited by pass 3: %llu\n",
+			(unsigned long long)stats->cell_bytes,
+			(unsigned long long)stats->visit_bytes);
+	report("  nk cells fetched: %llu, keys checked: %llu\n",
+			(unsigned long long)hive->nk_fetches,
+			(unsigned long long)hive->nk_visits);
+	report("  reads: %llu (%llu bytes), page faults: %ld (%ld major)\n",
+			(unsigned long long)stats->reads,
+			(unsigned long long)stats->read_bytes,
+			usage.ru_minflt + usage.ru_majflt, usage.ru_majflt);
+	report("  arena allocations: %llu, peak memory: %ld kB\n",
+			(unsigned long long)hive->arena_allocs, usage.ru_maxrss);
+}
@@ -18,363 +18,1061 @@
 #include <errno.h>
 #include <string.h>
 #include <talloc.h>
-#include <ctype.h>
 #include "regf.h"
 #include "chkregf.h"
 #include "config.h"
 
-char * get_nk_keyname(TALLOC_CTX *mem_ctx, FILE *fd, long int offset, long int parent_off)
+/* [SYN] Characters of a key name kept folded for the sort check */
+#define KEY_FOLD 12
+
+/* [SYN] The tree is walked with an explicit stack instead of recursion, so
+ * the depth of the tree is only limited by memory, and the walk doesn't
+ * allocate anything per cell. A frame says what to check at an offset.
+ * Subkey list frames are resumed after every subkey, so the output comes
+ * out in the same order as that of a recursive walk. */
+struct tree_frame {
+	hive_off_t offset;		/* [SYN] cell to check */
+	hive_off_t parent_off;		/* [SYN] referencing cell, 0 for none */
+	long int expect_count;		/* [SYN] expected count or length */
+	uint8_t *list;			/* [SYN] subkey list being walked */
+	uint8_t *prev_name;		/* [SYN] name of the previous subkey */
+	uint32_t index;			/* [SYN] next subkey list entry */
+	uint16_t prev_length;
+	uint8_t prev_compressed;
+	uint8_t prev_folded;		/* [SYN] characters in prev_fold */
+	uint16_t prev_fold[KEY_FOLD];	/* [SYN] start of prev_name, folded */
+	uint8_t expect;			/* [SYN] enum tree_expect */
+	uint8_t kind;			/* [SYN] enum record_kind of the cell */
+	struct hbin_data_block block;	/* [SYN] the cell, if already fetched */
+	uint8_t *sublist;		/* [SYN] ri: subkey list being walked */
+	hive_off_t sub_offset;		/* [SYN] ri: its offset, for display */
+	uint32_t sub_index;		/* [SYN] ri: next entry in it */
+	uint32_t sub_count;
+	uint8_t sub_kind;
+	uint32_t keys;			/* [SYN] ri: keys in the lists so far */
+	uint32_t owner;			/* [SYN] key whose check this is part of */
+};
+
+static const char *expect_names[] = {
+	[EXPECT_NK] = "nk",
+	[EXPECT_SK] = "sk",
+	[EXPECT_SUBKEYLIST] = "subkeylist",
+	[EXPECT_VALUELIST] = "valuelist",
+	[EXPECT_VK] = "vk",
+	[EXPECT_VALUE] = "value",
+	[EXPECT_DB] = "db",
+	[EXPECT_SEGMENTLIST] = "segmentlist",
+};
+
+static int tree_push(struct tree_stack *stack, hive_off_t offset, hive_off_t parent_off,
+		enum tree_expect expect, long int expect_count)
+{
+	struct tree_frame *frame;
+
+	if (stack->depth == stack->alloc) {
+		size_t alloc = stack->alloc ? stack->alloc * 2 : 256;
+		struct tree_frame *frames;
+
+		frames = realloc(stack->frames, alloc * sizeof(struct tree_frame));
+		if (!frames) {
+			diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+					"Memory allocation error\n");
+			return 0;
+		}
+		stack->frames = frames;
+		stack->alloc = alloc;
+	}
+	frame = &stack->frames[stack->depth++];
+	memset(frame, 0, sizeof(*frame));
+	frame->offset = offset;
+	frame->parent_off = parent_off;
+	frame->expect = expect;
+	frame->expect_count = expect_count;
+	frame->owner = expect == EXPECT_NK ? offset : stack->owner;
+	return 1;
+}
+
+void tree_stack_free(struct tree_stack *stack)
+{
+	free(stack->frames);
+	cache_log_free(&stack->keys);
+	cache_log_free(&stack->edges);
+	memset(stack, 0, sizeof(*stack));
+}
+
+/* [SYN] get_cell(), noting for --cache which key the cell was reached for */
+static int tree_get_cell(struct hive *hive, struct tree_stack *stack, uint32_t owner,
+		hive_off_t offset, hive_off_t parent_off, struct hbin_data_block *block)
+{
+	if (!get_cell(hive, offset, parent_off, block)) {
+		return 0;
+	}
+	if (stack->logging) {
+		cache_log_add(&stack->edges, owner, offset);
+	}
+	return 1;
+}
+
+/* [SYN] Character i of a key name, stored as Latin-1 or as UTF-16 */
+static inline uint16_t name_char(const uint8_t *name, int compressed, uint32_t i)
+{
+	uint16_t c;
+
+	if (compressed) {
+		return name[i];
+	}
+	memcpy(&c, name + 2 * i, 2);
+	return c;
+}
+
+/* [SYN] A key name in upper case, which is what Windows sorts and hashes
+ * on, made in one go over the name. */
+struct key_fold {
+	uint16_t fold[KEY_FOLD];	/* [SYN] start of the name, folded */
+	uint8_t folded;			/* [SYN] characters in fold */
+	uint8_t hint[4];		/* [SYN] lf hint the name should have */
+	uint32_t hash;			/* [SYN] lh hash, only for lh lists */
+};
+
+/* [SYN] Fold a key name from a subkey list of kind. The lf hint is the first
+ * 4 characters, padded with 0; if one of them doesn't fit in a byte there
+ * is no hint, it's all 0. The lh hash takes the whole name, other lists
+ * only need the start. */
+static void name_fold(const uint8_t *name, uint16_t length, int compressed,
+		uint8_t kind, struct key_fold *key)
+{
+	uint32_t chars = compressed ? length : length / 2;
+	uint32_t i, end = chars;
+	int hint = 1;
+
+	if (kind != RECORD_LH && end > KEY_FOLD) {
+		end = KEY_FOLD;
+	}
+	key->folded = chars < KEY_FOLD ? chars : KEY_FOLD;
+	key->hash = 0;
+	memset(key->hint, 0, sizeof(key->hint));
+	for (i = 0; i < end; i++) {
+		uint16_t c = name_char(name, compressed, i);
+		uint16_t u = upcase(c);
+
+		if (i < 4 && hint) {
+			if (c > 0xFF) {
+				memset(key->hint, 0, sizeof(key->hint));
+				hint = 0;
+			} else {
+				key->hint[i] = c;
+			}
+		}
+		if (i < KEY_FOLD) {
+			key->fold[i] = u;
+		}
+		key->hash = key->hash * 37 + u;
+	}
+}
+
+/* [SYN] Compare the previous subkey name of a list with name, the way
+ * Windows does: by UTF-16 character in upper case, and a name sorts before
+ * the names it is the start of. The folded starts almost always decide,
+ * only names that are alike in all of it are looked at any further. */
+static int name_cmp(const struct tree_frame *frame, const struct key_fold *key,
+		const uint8_t *name, uint16_t length, int compressed)
+{
+	uint32_t a_chars = frame->prev_compressed ? frame->prev_length : frame->prev_length / 2;
+	uint32_t b_chars = compressed ? length : length / 2;
+	uint32_t i, n = frame->prev_folded < key->folded ? frame->prev_folded : key->folded;
+
+	for (i = 0; i < n; i++) {
+		if (frame->prev_fold[i] != key->fold[i]) {
+			return frame->prev_fold[i] < key->fold[i] ? -1 : 1;
+		}
+	}
+	for (; i < a_chars && i < b_chars; i++) {
+		uint16_t a = upcase(name_char(frame->prev_name, frame->prev_compressed, i));
+		uint16_t b = upcase(name_char(name, compressed, i));
+
+		if (a != b) {
+			return a < b ? -1 : 1;
+		}
+	}
+	return a_chars < b_chars ? -1 : a_chars > b_chars;
+}
+
+/* [SYN] Fetch the nk record at offset, referenced from a subkey list at
+ * parent_off, and find its name and how it is stored. The block is handed
+ * on to the visit of the key, so every key is fetched once. The name points
+ * into the hive. */
+static int get_nk(struct hive *hive, struct tree_stack *stack, hive_off_t offset,
+		hive_off_t parent_off, struct hbin_data_block *block,
+		uint8_t **name, uint16_t *length, int *compressed)
 {
-	char *keyname;
-	struct hbin_data_block *block;
 	struct nk_record *nk;
-	
-	block = get_hbin_data_block(mem_ctx, fd, offset, parent_off);
-	if (!block) {
-		return NULL;
+
+	if (!tree_get_cell(hive, stack, offset, offset, parent_off, block)) {
+		return 0;
 	}
-	if (strncmp((char *)block->data, "nk", 2) != 0) {
-		printf("Error: Expected nk block at 0x%lx, parent 0x%lx\n", offset, parent_off);
-		talloc_free(block);
-		return NULL;
+	stack->nk_fetches++;
+	if (block->size < 6 || record_kind(block->data) != RECORD_NK) {
+		diag(DIAG_CELL_UNEXPECTED, offset, parent_off, RECORD_UNKNOWN,
+				"Expected nk block at 0x%lx, parent 0x%lx\n",
+				(long)offset, (long)cell_file_off(parent_off));
+		return 0;
 	}
 	nk = (struct nk_record *) block->data;
 
-	keyname = talloc_strndup(mem_ctx, (char *)&nk->keyname, nk->keyname_length);
-	talloc_free(block);
-	return keyname;
+	*name = &nk->keyname;
+	*compressed = (nk->type & NK_COMPRESSED_NAME) != 0;
+	*length = 0;
+	if (block->size >= 4 + 0x4C) {
+		*length = nk->keyname_length;
+		if (*length > block->size - 4 - 0x4C) {
+			*length = block->size - 4 - 0x4C;
+		}
+	}
+	return 1;
 }
 
-int parse_tree(TALLOC_CTX *parent_ctx,
-               FILE *fd,
-               long int offset,
-               long int parent_off,
-               const char *expect_type,
-               long int expect_count)
+/* [SYN] Parallel pass 3: every key in a subkey list becomes a task for the
+ * work stealing pool. To keep the output in the order of a sequential walk,
+ * a task records where in its output a child was spawned; the outputs are
+ * stitched together once all tasks are done. */
+struct tree_task;
+
+struct tree_piece {
+	size_t text_end;		/* [SYN] output before the child */
+	uint32_t found_end;		/* [SYN] findings before the child */
+	struct tree_task *child;
+};
+
+struct tree_job {
+	struct hive *hive;
+	struct arena **arenas;		/* [SYN] one arena per worker */
+	struct tree_stack *stacks;	/* [SYN] one walk stack per worker */
+	struct report_scope *scope;	/* [SYN] see report_use_scope() */
+	int error;
+};
+
+struct tree_task {
+	struct tree_job *job;
+	struct ws_pool *pool;
+	hive_off_t offset;
+	hive_off_t parent_off;
+	struct hbin_data_block block;
+	struct report_buf *out;
+	struct tree_piece *pieces;
+	uint32_t count;
+	uint32_t alloc;
+};
+
+static __thread struct tree_task *tree_current;
+
+static void tree_task_run(struct ws_pool *pool, void *arg)
 {
-	struct hbin_data_block *block;
-	int rv;
-	int error = 0;
-	TALLOC_CTX *mem_ctx;
+	struct tree_task *task = arg;
+	struct tree_task *saved = tree_current;
+	struct report_buf *saved_buf;
+	int worker = ws_worker_id();
 
-	mem_ctx = talloc_new(parent_ctx);
-	if (!mem_ctx) {
-		printf("Memory allocation error\n");
-		return 0;
+	task->pool = pool;
+	task->out = report_buf_arena(task->job->arenas[worker]);
+	if (!task->out) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
+		task->job->error = 1;
+		return;
 	}
+	tree_current = task;
+	saved_buf = report_set_buffer(task->out);
+	report_use_scope(task->job->scope);
 
-	block = get_hbin_data_block(mem_ctx, fd, offset, parent_off);
-	if (!block) {
-		return 0;
+	if (!parse_tree(task->job->hive, &task->job->stacks[worker],
+				task->offset, task->parent_off, EXPECT_NK, 0, &task->block)) {
+		task->job->error = 1;
 	}
 
-	/* [SYN] For display purposes, increase offset by 0x1000 */
-	offset += 0x1000;
-
-	/* [SYN] 
-	 * Based on the type of block we expect and actually get, parse the block
-	 */
-
-	/* [SYN] Value expected, this has no header so best we can do is check block length */
-	if (strcmp(expect_type, "value") == 0) {
-		if (block->size - 4 < expect_count) {
-			printf("Error: Block too small (0x%lxb) for value length (%ld) at 0x%lx\n",
-					(long)block->size, (long)expect_count, (long)offset);
-			talloc_free(mem_ctx);
-			return 0;
-		}	
-	/* [SYN] Value list expected, no header, so check block->size and traverse the values */
-	} else if (strcmp(expect_type, "valuelist") == 0) {
-		uint16_t i;
-		if (block->size < (expect_count+1)*sizeof(uint32_t)) {
-			printf("Error: Block too small (0x%lxb) for value count (%ld) at 0x%lx\n",
-					(long)block->size, (long)expect_count, (long)offset);
-			talloc_free(mem_ctx);
+	report_set_buffer(saved_buf);
+	tree_current = saved;
+}
+
+/* [SYN] Check the key at offset and everything below it. Pushed on the
+ * stack, or spawned as a separate task when pass 3 runs in parallel. */
+static int tree_child(struct hive *hive, struct tree_stack *stack, hive_off_t offset,
+		hive_off_t parent_off, struct hbin_data_block *block)
+{
+	struct tree_task *task = tree_current;
+	struct tree_task *child;
+	struct arena *arena;
+
+	/* [SYN] Nothing changed below this key since the cache was written */
+	if (cache_replay(hive, stack, offset, parent_off)) {
+		return 1;
+	}
+	if (!task) {
+		if (!tree_push(stack, offset, parent_off, EXPECT_NK, 0)) {
 			return 0;
 		}
-		for (i = 0; i < expect_count; i++) {
-			uint32_t vl_offset = ((uint32_t *)block->data)[i];
-			rv = parse_tree(mem_ctx, fd, vl_offset, parent_off, "vk", 0);
-			if (!rv) {
-				error = 1;
+		stack->frames[stack->depth-1].block = *block;
+		return 1;
+	}
+
+	arena = task->job->arenas[ws_worker_id()];
+	if (task->count == task->alloc) {
+		uint32_t alloc = task->alloc ? task->alloc * 2 : 4;
+		struct tree_piece *pieces;
+
+		pieces = arena_alloc(arena, alloc * sizeof(struct tree_piece));
+		if (!pieces) {
+			return tree_push(stack, offset, parent_off, EXPECT_NK, 0);
+		}
+		if (task->count) {
+			memcpy(pieces, task->pieces, task->count * sizeof(struct tree_piece));
+		}
+		task->pieces = pieces;
+		task->alloc = alloc;
+	}
+	child = arena_alloc(arena, sizeof(struct tree_task));
+	if (!child) {
+		return tree_push(stack, offset, parent_off, EXPECT_NK, 0);
+	}
+	child->job = task->job;
+	child->offset = offset;
+	child->parent_off = parent_off;
+	child->block = *block;
+
+	task->pieces[task->count].text_end = task->out->len;
+	task->pieces[task->count].found_end = task->out->count;
+	task->pieces[task->count].child = child;
+	task->count++;
+
+	ws_spawn(task->pool, tree_task_run, child);
+	return 1;
+}
+
+/* [SYN] Pass the output of all tasks on in the order of a sequential walk */
+static void tree_task_flush(struct tree_task *root)
+{
+	struct tree_flush {
+		struct tree_task *task;
+		uint32_t piece;
+		size_t text_pos;
+		uint32_t found_pos;
+	} *stack;
+	size_t depth = 0, alloc = 64;
+
+	stack = malloc(alloc * sizeof(*stack));
+	if (!stack) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
+		return;
+	}
+	stack[depth].task = root;
+	stack[depth].piece = 0;
+	stack[depth].text_pos = 0;
+	stack[depth].found_pos = 0;
+	depth++;
+
+	while (depth > 0) {
+		struct tree_flush *top = &stack[depth-1];
+		struct tree_task *task = top->task;
+		struct tree_task *child;
+		size_t end;
+		uint32_t found_end;
+
+		if (!task->out) {
+			depth--;
+			continue;
+		}
+		if (top->piece == task->count) {
+			end = task->out->len;
+			found_end = task->out->count;
+			child = NULL;
+		} else {
+			end = task->pieces[top->piece].text_end;
+			found_end = task->pieces[top->piece].found_end;
+			child = task->pieces[top->piece].child;
+		}
+		report_flush_part(task->out, top->text_pos, end, top->found_pos, found_end);
+		top->text_pos = end;
+		top->found_pos = found_end;
+		if (!child) {
+			depth--;
+			continue;
+		}
+		top->piece++;
+
+		if (depth == alloc) {
+			struct tree_flush *bigger;
+
+			bigger = realloc(stack, alloc * 2 * sizeof(*stack));
+			if (!bigger) {
+				diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+						"Memory allocation error\n");
+				break;
 			}
+			stack = bigger;
+			alloc *= 2;
 		}
+		stack[depth].task = child;
+		stack[depth].piece = 0;
+		stack[depth].text_pos = 0;
+		stack[depth].found_pos = 0;
+		depth++;
+	}
+	free(stack);
+}
+
+/* [SYN] Value expected, this has no header so best we can do is check block length */
+static int visit_value(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	if (block->size - 4 < frame->expect_count) {
+		diag(DIAG_CELL_TOO_SMALL, offset, frame->parent_off, RECORD_UNKNOWN,
+				"Block too small (0x%lxb) for value length (%ld) at 0x%lx\n",
+				(long)block->size, (long)frame->expect_count, (long)offset);
+		return 0;
+	}
+	return 1;
+}
+
+/* [SYN] Value list expected, no header, so check block->size and traverse the values */
+static int visit_valuelist(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	long int i;
+
+	if (block->size < (frame->expect_count+1)*sizeof(uint32_t)) {
+		diag(DIAG_CELL_TOO_SMALL, offset, frame->parent_off, RECORD_UNKNOWN,
+				"Block too small (0x%lxb) for value count (%ld) at 0x%lx\n",
+				(long)block->size, (long)frame->expect_count, (long)offset);
+		return 0;
+	}
+	/* [SYN] Last one first, so they come off the stack in order */
+	for (i = frame->expect_count - 1; i >= 0; i--) {
+		uint32_t vl_offset = ((uint32_t *)block->data)[i];
+
+		if (!tree_push(stack, vl_offset, frame->parent_off, EXPECT_VK, 0)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* [SYN] We got an 'nk' block. */
+static int visit_nk(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	struct nk_record *nk = (struct nk_record *) block->data;
+	hive_off_t parent_off = frame->parent_off;
+	int error = 0;
+
+	if (!record_fits(RECORD_NK, block->size, offset, frame->parent_off)) {
+		return 0;
+	}
+
+	/* [SYN] If we didn't expect an nk block, the registry is corrupt. */
+	if (frame->expect != EXPECT_NK) {
+		diag(DIAG_CELL_UNEXPECTED, offset, frame->parent_off, RECORD_NK,
+				"Unexpected 'nk' record at 0x%lx, expected %s\n",
+				(long)offset, expect_names[frame->expect]);
+		return 0;
+	}
+	stack->nk_visits++;
+	if (stack->logging) {
+		cache_log_add(&stack->keys, offset - 0x1000, parent_off);
+	}
+
+	/* [SYN] Check if the parent is consistent with our data about the parent. */
+	if (nk->parent_offset != parent_off && nk->type != 0x2C) {
+		diag(DIAG_NK_PARENT, offset, frame->parent_off, RECORD_NK,
+				"Incorrect parent offset for nk record at 0x%lx\n",
+				(long)offset);
+		error = 1;
+	}
 
-	/* [SYN] We got an 'nk' block. */
-	} else if (strncmp((char *)block->data, "nk", 2) == 0) {
-		struct nk_record *nk = (struct nk_record *) block->data;
+	/* [SYN] If we have a parent, this should not be a root key */
+	if (nk->type == 0x2C && parent_off != 0) {
+		diag(DIAG_NK_ROOT, offset, parent_off, RECORD_NK,
+				"Unexpected root key at 0x%lx, parent 0x%lx\n",
+			(long)offset, (long)cell_file_off(parent_off));
+		error = 1;
+	}
 #if DODEBUG > 2
-		char *keyname;
+	report("==== KEY ====\n");
+	report("Key name:            %.*s\n", nk->keyname_length, (char *)&nk->keyname);
+	report("Type:                %X\n", nk->type);
+	report("Parent offset:       0x%lx\n", (long) nk->parent_offset);
+	report("Number of subkeys:   %ld\n", (long) nk->subkey_count);
+	report("Subkey dir offset:   0x%lx\n", (long) nk->subkey_offset);
+	report("Number of values:    %ld\n", (long) nk->value_count);
+	report("Value list offset:   0x%lx\n", (long) nk->value_offset);
+	report("Security key offset: 0x%lx\n", (long) nk->sk_offset);
+	report("Class name offset:   0x%lx\n", (long) nk->classname_offset);
+	report("Key name length:     %ld\n", (long) nk->keyname_length);
+
 #endif
-		/* [SYN] If we didn't expect an nk block, the registry is corrupt. */
-		if (strncmp(expect_type, "nk", 2) != 0) {
-			printf("Error: Unexpected 'nk' record at 0x%lx, expected %s\n",
-					(long)offset, expect_type);
-			talloc_free(mem_ctx);
-			return 0;
+	/* [SYN] Children in reverse order: class name, security key, subkeys
+	 * and values come off the stack in that order. */
+	if (nk->value_count > 0) {
+		if (!tree_push(stack, nk->value_offset, offset-0x1000, EXPECT_VALUELIST, nk->value_count)) {
+			error = 1;
 		}
-	
-		/* [SYN] Check if the parent is consistent with our data about the parent. */
-		if (nk->parent_offset != parent_off && nk->type != 0x2C) {
-			printf("Error: Incorrect parent offset for nk record at 0x%lx\n",
-					(long)offset);
+	}
+	if (nk->subkey_count > 0) {
+		if (!tree_push(stack, nk->subkey_offset, offset-0x1000, EXPECT_SUBKEYLIST, nk->subkey_count)) {
 			error = 1;
 		}
-
-		/* [SYN] If we have a parent, this should not be a root key */
-		if (nk->type == 0x2C && parent_off != 0) {
-			printf("Error: Unexpected root key at 0x%lx, parent 0x%lx\n",
-				(long)offset, (long)parent_off);
+	}
+	if (!tree_push(stack, nk->sk_offset, offset-0x1000, EXPECT_SK, 0)) {
+		error = 1;
+	}
+	if (nk->classname_length > 0) {
+		if (!tree_push(stack, nk->classname_offset, offset-0x1000, EXPECT_VALUE, nk->classname_length)) {
 			error = 1;
 		}
-#if DODEBUG > 2
-		printf("==== KEY ====\n");
+	}
+	return !error;
+}
 
-		keyname = talloc_strndup(mem_ctx, (char *)&nk->keyname, nk->keyname_length);
-		if (!keyname) {
-			printf("Allocating %ld bytes of memory failed.\n",
-					(long)nk->keyname_length);
-			talloc_free(mem_ctx);
-			return 0;
+/* [SYN] Check the entries of a subkey list (lf, lh or li) from *index on,
+ * until a key can be queued. A copy of frame is pushed first, to come back
+ * to after that key is done; if resume isn't set, only while entries are
+ * left. Returns 1 if a key was queued, 0 if the list is done. */
+static int list_next(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		uint8_t *data, uint8_t kind, uint32_t count, uint32_t *index,
+		hive_off_t offset, int resume, int *error)
+{
+	struct li_record *list = (struct li_record *) data;
+	struct hbin_data_block key;
+	hive_off_t parent_off = frame->parent_off;
+	uint32_t entry_size = kind == RECORD_LI ? 4 : 8;
+	uint8_t *entry;
+	uint32_t key_offset;
+	uint8_t *name;
+	uint16_t length;
+	int compressed;
+	struct key_fold fold;
+	uint32_t hash;
+
+	for (; *index < count; (*index)++) {
+		entry = &list->data + *index * entry_size;
+		memcpy(&key_offset, entry, 4);
+
+		if (!get_nk(hive, stack, key_offset, offset - 0x1000, &key, &name, &length, &compressed)) {
+			*error = 1;
+			continue;
 		}
-		printf("Key name:            %s\n", keyname);
-		printf("Type:                %X\n", nk->type);
-		printf("Parent offset:       0x%lx\n", (long) nk->parent_offset);
-		printf("Number of subkeys:   %ld\n", (long) nk->subkey_count);
-		printf("Subkey dir offset:   0x%lx\n", (long) nk->subkey_offset);
-		printf("Number of values:    %ld\n", (long) nk->value_count);
-		printf("Value list offset:   0x%lx\n", (long) nk->value_offset);
-		printf("Security key offset: 0x%lx\n", (long) nk->sk_offset);
-		printf("Class name offset:   0x%lx\n", (long) nk->classname_offset);
-		printf("Key name length:     %ld\n", (long) nk->keyname_length);
 
-#endif
-		/* [SYN] If we have a class name, parse it */
-		if (nk->classname_length > 0) {
-			rv = parse_tree(mem_ctx, fd, nk->classname_offset, offset-0x1000, "value", nk->classname_length);
-			if (!rv) {
-				error = 1;
-			}
+		/* [SYN] Check if the keys are sorted the way Windows sorts them,
+		 * and the lf hint or lh hash, all from one fold of the name */
+		name_fold(name, length, compressed, kind, &fold);
+		if (frame->prev_name != NULL &&
+				name_cmp(frame, &fold, name, length, compressed) > 0) {
+			diag(DIAG_LIST_SORT, offset, parent_off, kind,
+					"%s block is not sorted by name at 0x%lx, parent 0x%lx\n",
+					record_kind_name(kind), (long)offset, (long)cell_file_off(parent_off));
+			*error = 1;
 		}
-		/* [SYN] Parse the security key */
-		rv = parse_tree(mem_ctx, fd, nk->sk_offset, offset-0x1000, "sk", 0);
-		if (!rv) {
-			error = 1;
+
+		if (kind == RECORD_LH) {
+			memcpy(&hash, entry + 4, 4);
+		}
+		if (kind == RECORD_LF && memcmp(fold.hint, entry + 4, 4) != 0) {
+			diag(DIAG_LF_HINT, offset, parent_off, RECORD_LF,
+					"Incorrect first 4 bytes of key name (0x%lx) in lf block at 0x%lx\n",
+					(long)key_offset, (long)offset);
+			*error = 1;
+		} else if (kind == RECORD_LH && hash != fold.hash) {
+			diag(DIAG_LH_HASH, offset, parent_off, RECORD_LH,
+					"lh block has incorrect hash for offset 0x%lx at 0x%lx\n",
+					(long)key_offset, (long)offset);
+			*error = 1;
 		}
 
-		/* [SYN] If we have subkeys, parse the subkeys */
-		if (nk->subkey_count > 0) {
-			rv = parse_tree(mem_ctx, fd, nk->subkey_offset, offset-0x1000, "subkeylist", nk->subkey_count);
-			if (!rv) {
-				error = 1;
+		/* [SYN] Keep the key name, folded, for the next entry */
+		frame->prev_name = name;
+		frame->prev_length = length;
+		frame->prev_compressed = compressed;
+		frame->prev_folded = fold.folded;
+		memcpy(frame->prev_fold, fold.fold, fold.folded * sizeof(fold.fold[0]));
+
+		/* [SYN] Come back for the next entry after this subkey is done */
+		(*index)++;
+		if (resume || *index < count) {
+			struct tree_frame copy = *frame;
+
+			if (!tree_push(stack, 0, 0, EXPECT_SUBKEYLIST, 0)) {
+				*error = 1;
+				return 0;
 			}
+			stack->frames[stack->depth-1] = copy;
 		}
-		/* [SYN] If we have values, parse the values */
-		if (nk->value_count > 0) {
-			rv = parse_tree(mem_ctx, fd, nk->value_offset, offset-0x1000, "valuelist", nk->value_count);
-			if (!rv) {
-				error = 1;
-			}
+		if (!tree_child(hive, stack, key_offset, parent_off, &key)) {
+			*error = 1;
 		}
-	
-		
-	} else if (strncmp((char *)block->data, "sk", 2) == 0) {
-		if (strcmp(expect_type, "sk") != 0) {
-			printf("Error: Did not expect sk block here\n");
-			error = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/* [SYN] Subkey lists (lf, lh and li). The first visit checks the list itself,
+ * every visit checks one entry and queues the key it points to. */
+static int visit_list(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	struct li_record *list = (struct li_record *) block->data;
+	hive_off_t parent_off = frame->parent_off;
+	uint32_t entry_size = frame->kind == RECORD_LI ? 4 : 8;
+	uint32_t count;
+	int error = 0;
+
+	if (!record_fits(frame->kind, block->size, offset, frame->parent_off)) {
+		return 0;
+	}
+	count = list->key_count;
+
+	/* [SYN] Don't walk past the end of the block */
+	if (count > (block->size - 8) / entry_size) {
+		count = (block->size - 8) / entry_size;
+	}
+
+	if (!frame->list) {
+		if (frame->kind == RECORD_LI) {
+			report("This is an li block\n");
 		}
-		/* TODO: Count sk references */
-		/* TODO: Check security descriptor */
-	} else if (strncmp((char *)block->data, "ri", 2) == 0) {
-		printf("This is an ri block, cannot check this.\n");
-		if (strcmp(expect_type, "subkeylist") != 0) {
-			printf("Error: Did not expect subkey list, expected %s at 0x%lx, parent 0x%lx\n",
-					expect_type, (long)offset, (long)parent_off);
+		if (frame->expect != EXPECT_SUBKEYLIST) {
+			diag(DIAG_CELL_UNEXPECTED, offset, frame->parent_off, frame->kind,
+					"Did not expect subkey list, expected %s at 0x%lx, parent 0x%lx\n",
+					expect_names[frame->expect], (long)offset, (long)cell_file_off(parent_off));
 			error = 1;
 		}
-		error = 1;
-	} else if (strncmp((char *)block->data, "li", 2) == 0) {
-		struct li_record *li = (struct li_record *)block->data;
-		char *keyname;
-		char *prev_keyname = NULL;
-		uint16_t i;
-
-		printf("This is an li block\n");
-		if (strcmp(expect_type, "subkeylist") != 0) {
-			printf("Error: Did not expect subkey list, expected %s at 0x%lx, parent 0x%lx\n",
-					expect_type, (long)offset, (long)parent_off);
+		/* [SYN] Check if the key count matches that of the parent */
+		if (list->key_count != frame->expect_count) {
+			diag(DIAG_LIST_COUNT, offset, frame->parent_off, frame->kind,
+					"Expected %ld subkeys, got %ld subkeys at 0x%lx\n",
+					(long)frame->expect_count, (long)list->key_count, (long)offset);
 			error = 1;
 		}
-		/* [SYN] Check if the key count matches that of the parent */
-		if (li->key_count != expect_count) {
-			printf("Error: Expected %ld subkeys, got %ld subkeys at 0x%lx\n",
-					(long)expect_count, (long)li->key_count, (long)offset);
+		if (count < list->key_count) {
+			diag(DIAG_LIST_SIZE, offset, frame->parent_off, frame->kind,
+					"Size doesn't match key count (0x%lx)!\n",
+					(long)offset);
 			error = 1;
 		}
-		
-		for (i = 0; i < li->key_count; i++) {
-			struct li_record_data *data = &(((struct li_record_data *)&li->data)[i]);
+		frame->list = block->data;
+		frame->block = *block;
+	}
 
-			keyname = get_nk_keyname(mem_ctx, fd, data->offset, offset);
-			
-			/* [SYN] Check if the keys are sorted alphabetically */
-			if (prev_keyname != NULL && strcasecmp(prev_keyname, keyname) > 0) {
-				printf("Error: lf block is not sorted by name at 0x%lx, parent 0x%lx\n",
-						(long)offset, (long)parent_off);
-				error = 1;
-			}
+	list_next(hive, stack, frame, block->data, frame->kind, count,
+			&frame->index, offset, 0, &error);
+	return !error;
+}
 
-			rv = parse_tree(mem_ctx, fd, data->offset, parent_off, "nk", 0);
-			if (!rv) {
-				error = 1;
-			}
-			/* [SYN] Set the previous key name (free previous if exists) */
-			if (prev_keyname) {
-				talloc_free(prev_keyname);
-			}
-			prev_keyname = keyname;
-		}
-		talloc_free(keyname);
-	} else if (strncmp((char *)block->data, "lf", 2) == 0) {
-		struct lf_record *lf = (struct lf_record *)block->data;
-		char *keyname;
-		char *prev_keyname = NULL;
-		uint16_t i;
-
-		if (strcmp(expect_type, "subkeylist") != 0) {
-			printf("Error: Did not expect subkey list, expected %s at 0x%lx, parent 0x%lx\n",
-					expect_type, (long)offset, (long)parent_off);
-			error = 1;
+/* [SYN] Index root: a list of subkey lists, for keys with too many subkeys
+ * for one list. The lists are walked as if they were one, so the sort
+ * order is checked across them and the keys are counted in total. */
+static int visit_ri(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	struct ri_record *ri = (struct ri_record *) block->data;
+	uint32_t count;
+	int error = 0;
+
+	if (!record_fits(RECORD_RI, block->size, offset, frame->parent_off)) {
+		return 0;
+	}
+	count = ri->count;
+	if (count > (block->size - 8) / 4) {
+		count = (block->size - 8) / 4;
+	}
+
+	if (!frame->list) {
+		if (frame->expect != EXPECT_SUBKEYLIST) {
+			diag(DIAG_CELL_UNEXPECTED, offset, frame->parent_off, frame->kind,
+					"Did not expect subkey list, expected %s at 0x%lx, parent 0x%lx\n",
+					expect_names[frame->expect], (long)offset, (long)cell_file_off(frame->parent_off));
+			return 0;
 		}
-		/* [SYN] Check if the key count matches that of the parent */
-		if (lf->key_count != expect_count) {
-			printf("Error: Expected %ld subkeys, got %ld subkeys at 0x%lx\n",
-					(long)expect_count, (long)lf->key_count, (long)offset);
+		if (count < ri->count) {
+			diag(DIAG_LIST_SIZE, offset, frame->parent_off, RECORD_RI,
+					"Size doesn't match offset count (0x%lx)!\n",
+					(long)offset);
 			error = 1;
 		}
-		for (i = 0; i < lf->key_count; i++) {
-			struct lf_record_data *data = &(((struct lf_record_data *)&lf->data)[i]);
+		frame->list = block->data;
+		frame->block = *block;
+	}
 
-			keyname = get_nk_keyname(mem_ctx, fd, data->offset, offset);
-			
-			/* [SYN] Check if the keys are sorted alphabetically */
-			if (prev_keyname != NULL && strcasecmp(prev_keyname, keyname) > 0) {
-				printf("Error: lf block is not sorted by name at 0x%lx, parent 0x%lx\n",
-						(long)offset, (long)parent_off);
-				error = 1;
-			}
+	while (frame->index < count) {
+		if (!frame->sublist) {
+			struct hbin_data_block sub;
+			struct li_record *list;
+			uint32_t entry_size;
+			uint32_t sub_offset;
+			uint8_t kind;
 
-			/* [SYN] Verify first 4 bytes name in lf data record with the key name */
-			if (strncmp(data->name, keyname, 4) != 0) {
-				printf("Error: Incorrect first 4 bytes of key name (0x%lx) in lf block at 0x%lx\n",
-						(long)data->offset, (long)offset);
+			memcpy(&sub_offset, &ri->data + frame->index * 4, 4);
+			if (!tree_get_cell(hive, stack, frame->owner, sub_offset, offset - 0x1000, &sub)) {
 				error = 1;
+				frame->index++;
+				continue;
 			}
-
-			rv = parse_tree(mem_ctx, fd, data->offset, parent_off, "nk", 0);
-			if (!rv) {
+			kind = sub.size < 8 ? RECORD_UNKNOWN : record_kind(sub.data);
+			if (kind != RECORD_LF && kind != RECORD_LH && kind != RECORD_LI) {
+				diag(DIAG_CELL_UNEXPECTED, sub_offset+0x1000, offset - 0x1000, kind,
+						"Expected lf, lh or li block at 0x%lx, parent 0x%lx\n",
+						(long)sub_offset+0x1000, (long)offset);
 				error = 1;
+				frame->index++;
+				continue;
 			}
-
-			/* [SYN] Set the previous key name (free previous if exists) */
-			if (prev_keyname) {
-				talloc_free(prev_keyname);
+			list = (struct li_record *) sub.data;
+			entry_size = kind == RECORD_LI ? 4 : 8;
+			frame->sublist = sub.data;
+			frame->sub_offset = sub_offset+0x1000;
+			frame->sub_kind = kind;
+			frame->sub_index = 0;
+			frame->sub_count = list->key_count;
+			if (frame->sub_count > (sub.size - 8) / entry_size) {
+				frame->sub_count = (sub.size - 8) / entry_size;
+				diag(DIAG_LIST_SIZE, frame->sub_offset, offset - 0x1000, frame->sub_kind,
+						"Size doesn't match key count (0x%lx)!\n",
+						(long)frame->sub_offset);
+				error = 1;
 			}
-			prev_keyname = keyname;
+			frame->keys += list->key_count;
 		}
-		talloc_free(keyname);
+		if (list_next(hive, stack, frame, frame->sublist, frame->sub_kind,
+					frame->sub_count, &frame->sub_index,
+					frame->sub_offset, 1, &error)) {
+			return !error;
+		}
+		frame->sublist = NULL;
+		frame->index++;
+	}
 
-	} else if (strncmp((char *)block->data, "lh", 2) == 0) {
-		struct lh_record *lh = (struct lh_record *)block->data;
-		char *keyname;
-		char *prev_keyname = NULL;
-		uint16_t i;
+	/* [SYN] All lists done, check if the key count matches that of the parent */
+	if (frame->keys != frame->expect_count) {
+		diag(DIAG_LIST_COUNT, offset, frame->parent_off, frame->kind,
+				"Expected %ld subkeys, got %ld subkeys at 0x%lx\n",
+				(long)frame->expect_count, (long)frame->keys, (long)offset);
+		error = 1;
+	}
+	return !error;
+}
 
-		if (strcmp(expect_type, "subkeylist") != 0) {
-			printf("Error: Did not expect subkey list, expected %s at 0x%lx, parent 0x%lx\n",
-					expect_type, (long)offset, (long)parent_off);
-			error = 1;
+static int visit_sk(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	if (!record_fits(RECORD_SK, block->size, offset, frame->parent_off)) {
+		return 0;
+	}
+	if (frame->expect != EXPECT_SK) {
+		diag(DIAG_CELL_UNEXPECTED, offset, frame->parent_off, RECORD_SK,
+				"Did not expect sk block here\n");
+		return 0;
+	}
+	sk_table_ref(hive, frame->offset, block);
+	/* TODO: Check security descriptor */
+	return 1;
+}
+
+static int visit_vk(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	struct vk_record *vk = (struct vk_record *) block->data;
+	int error = 0;
+
+	if (!record_fits(RECORD_VK, block->size, offset, frame->parent_off)) {
+		return 0;
+	}
+	/* [SYN] If we didn't expect a vk record specifically, this registry is corrupt */
+	if (frame->expect != EXPECT_VK) {
+		diag(DIAG_CELL_UNEXPECTED, offset, frame->parent_off, RECORD_VK,
+				"did not expect vk block, expected %s at 0x%lx, parent 0x%lx\n",
+				expect_names[frame->expect], (long)offset, (long)cell_file_off(frame->parent_off));
+		error = 1;
+	}
+#if DODEBUG > 2
+	report("==== VALUE ====\n"); 
+	report("name:     %.*s\n", vk->name_length, (char *)&vk->name);
+	report("name len: %ld\n", (long)vk->name_length);
+	report("data len: 0x%08lx\n", (long)vk->data_length);
+	report("data off: 0x%lx\n", (long)vk->data_offset);
+	report("type:     0x%lx\n\n", (long)vk->type);
+#endif
+	if (!(vk->data_length & 0x80000000)) {
+		enum tree_expect expect = EXPECT_VALUE;
+
+		/* [SYN] Since 1.4, large values are stored in segments */
+		if (vk->data_length > DB_SEGMENT_SIZE && hive->regf.version[1] >= 4) {
+			expect = EXPECT_DB;
 		}
-		if (lh->key_count != expect_count) {
-			printf("Error: Expected %ld subkeys, got %ld subkeys at 0x%lx\n",
-					(long)expect_count, (long)lh->key_count, (long)offset);
+		if (!tree_push(stack, vk->data_offset, offset - 0x1000, expect, vk->data_length)) {
 			error = 1;
 		}
-		
-		for (i = 0; i < lh->key_count; i++) {
-			struct lh_record_data *data = &(((struct lh_record_data *)&lh->data)[i]);
-			uint32_t hash;
-			uint16_t j;
-			keyname = get_nk_keyname(mem_ctx, fd, data->offset, offset);
-			
-			/* [SYN] Check if the keys are sorted alphabetically */
-			if (prev_keyname != NULL && strcasecmp(prev_keyname, keyname) > 0) {
-				printf("Error: lf block is not sorted by name at 0x%lx, parent 0x%lx\n",
-						(long)offset, (long)parent_off);
-				error = 1;
-			}
+	}
+	return !error;
+}
 
-			/* [SYN] Compute hash */
-			/* FIXME: toupper is inconsistent with Windows for special characters */
-			for (j = 0; j < strlen(keyname); j++) {
-				hash *= 37;
-				hash += toupper(keyname[i]);
-			}
+/* [SYN] Big data record of a value of expect_count bytes */
+static int visit_db(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	struct db_record *db = (struct db_record *) block->data;
+	long int segments = (frame->expect_count + DB_SEGMENT_SIZE - 1) / DB_SEGMENT_SIZE;
+	int error = 0;
 
-			/* [SYN] Verify if the computed hash is identical to the stored hash */
-			if (hash != data->hash) {
-				printf("Error: lh block has incorrect hash for offset 0x%lx at 0x%lx\n",
-						(long)data->offset, (long)offset);
-				error = 1;
-			}
+	if (!record_fits(RECORD_DB, block->size, offset, frame->parent_off)) {
+		return 0;
+	}
+	if (frame->expect != EXPECT_DB) {
+		diag(DIAG_CELL_UNEXPECTED, offset, frame->parent_off, RECORD_DB,
+				"Did not expect db block, expected %s at 0x%lx, parent 0x%lx\n",
+				expect_names[frame->expect], (long)offset, (long)cell_file_off(frame->parent_off));
+		return 0;
+	}
+	if (db->segment_count != segments) {
+		diag(DIAG_DB_COUNT, offset, frame->parent_off, RECORD_DB,
+				"Expected %ld data segments, got %ld at 0x%lx\n",
+				segments, (long)db->segment_count, (long)offset);
+		error = 1;
+	}
+	if (!tree_push(stack, db->segment_offset, offset - 0x1000, EXPECT_SEGMENTLIST, frame->expect_count)) {
+		error = 1;
+	}
+	return !error;
+}
 
-			rv = parse_tree(mem_ctx, fd, data->offset, parent_off, "nk", 0);
-			if (!rv) {
-				error = 1;
-			}
+/* [SYN] Segment list of a value of expect_count bytes. Every segment but the
+ * last holds DB_SEGMENT_SIZE bytes; they are checked one cell at a time, the
+ * value is never put together. */
+static int visit_segmentlist(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	long int segments = (frame->expect_count + DB_SEGMENT_SIZE - 1) / DB_SEGMENT_SIZE;
+	long int i;
+
+	if (block->size < (segments+1)*sizeof(uint32_t)) {
+		diag(DIAG_CELL_TOO_SMALL, offset, frame->parent_off, RECORD_DB,
+				"Block too small (0x%lxb) for segment count (%ld) at 0x%lx\n",
+				(long)block->size, segments, (long)offset);
+		return 0;
+	}
+	/* [SYN] Last one first, so they come off the stack in order */
+	for (i = segments - 1; i >= 0; i--) {
+		uint32_t seg_offset = ((uint32_t *)block->data)[i];
+		long int length = DB_SEGMENT_SIZE;
+
+		if (i == segments - 1) {
+			length = frame->expect_count - i * DB_SEGMENT_SIZE;
 		}
-	} else if (strncmp((char *)block->data, "vk", 2) == 0) {
-		struct vk_record *vk = (struct vk_record *) block->data;
-#if DODEBUG > 2
-		char *valuename;
-#endif
-		/* [SYN] If we didn't expect a vk record specifically, this registry is corrupt */
-		if (strcmp(expect_type, "vk") != 0) {
-			printf("Error: did not expect vk block, expected %s at 0x%lx, parent 0x%lx\n",
-					expect_type, (long)offset, (long)parent_off);
-			error = 1;
+		if (!tree_push(stack, seg_offset, offset - 0x1000, EXPECT_VALUE, length)) {
+			return 0;
 		}
-#if DODEBUG > 2
-		printf("==== VALUE ====\n"); 
-		valuename = talloc_strndup(mem_ctx, (char *)&vk->name, vk->name_length);
-		if (!keyname) {
-			printf("Allocating %ld bytes of memory failed.\n",
-					(long)nk->keyname_length);
-			talloc_free(mem_ctx);
+	}
+	return 1;
+}
+
+static int visit_unknown(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame,
+		struct hbin_data_block *block, hive_off_t offset)
+{
+	diag(DIAG_CELL_UNKNOWN, offset, frame->parent_off, frame->kind,
+			"Unknown data at 0x%lx!\n", (long)offset);
+	return 0;
+}
+
+/* [SYN] What to do with a cell, by what was expected and what it turned out
+ * to be. Cells with a signature are handled by kind, the handler complains
+ * if that isn't what was expected. Value lists and value data have no
+ * signature, so there the kind doesn't matter. */
+typedef int (*tree_visit_fn)(struct hive *hive, struct tree_stack *stack,
+		struct tree_frame *frame, struct hbin_data_block *block, hive_off_t offset);
+
+#define VISIT_BY_KIND { \
+	[RECORD_UNKNOWN] = visit_unknown, \
+	[RECORD_NK] = visit_nk, \
+	[RECORD_SK] = visit_sk, \
+	[RECORD_VK] = visit_vk, \
+	[RECORD_LF] = visit_list, \
+	[RECORD_LH] = visit_list, \
+	[RECORD_LI] = visit_list, \
+	[RECORD_RI] = visit_ri, \
+	[RECORD_DB] = visit_db, \
+}
+#define VISIT_ANY(fn) { [0 ... RECORD_KINDS-1] = fn }
+
+static const tree_visit_fn tree_dispatch[EXPECT_KINDS][RECORD_KINDS] = {
+	[EXPECT_NK] = VISIT_BY_KIND,
+	[EXPECT_SK] = VISIT_BY_KIND,
+	[EXPECT_SUBKEYLIST] = VISIT_BY_KIND,
+	[EXPECT_VALUELIST] = VISIT_ANY(visit_valuelist),
+	[EXPECT_VK] = VISIT_BY_KIND,
+	[EXPECT_VALUE] = VISIT_ANY(visit_value),
+	[EXPECT_DB] = VISIT_BY_KIND,
+	[EXPECT_SEGMENTLIST] = VISIT_ANY(visit_segmentlist),
+};
+
+/* [SYN] Check the cell of one frame, pushing whatever it refers to */
+static int tree_visit(struct hive *hive, struct tree_stack *stack, struct tree_frame *frame)
+{
+	struct hbin_data_block block;
+	int fetched = 0;
+
+	stack->owner = frame->owner;
+	if (frame->block.data) {
+		block = frame->block;
+	} else {
+		if (!tree_get_cell(hive, stack, frame->owner, frame->offset,
+					frame->parent_off, &block)) {
 			return 0;
 		}
-		printf("name:     %s\n", valuename);
-		printf("name len: %ld\n", (long)vk->name_length);
-		printf("data len: 0x%08lx\n", (long)vk->data_length);
-		printf("data off: 0x%lx\n", (long)vk->data_offset);
-		printf("type:     0x%lx\n\n", (long)vk->type);
-#endif
-		if (!(vk->data_length & 0x80000000)) {
-			rv = parse_tree(mem_ctx, fd, vk->data_offset, offset, "value", vk->data_length);
-			if (!rv) {
-				error = 1;
-			}
+		fetched = 1;
+	}
+
+	/* [SYN] A subkey list we're halfway through knows its kind already */
+	if (!frame->list) {
+		frame->kind = block.size < 8 ? RECORD_UNKNOWN : record_kind(block.data);
+		if (fetched && frame->kind == RECORD_NK) {
+			stack->nk_fetches++;
 		}
-	} else {
-		printf("Unknown data at 0x%lx!\n", (long)offset);
-		error = 1;
+		stack->visits[frame->kind]++;
+		stack->bytes += block.size;
+	}
+
+	/* [SYN] For display purposes, increase offset by 0x1000 */
+	return tree_dispatch[frame->expect][frame->kind](hive, stack, frame, &block,
+			frame->offset + 0x1000);
+}
+
+/* [SYN] Check the cell at offset, expected to be of type expect, and
+ * everything it refers to. block is the cell if the caller fetched it
+ * already, or NULL. The stack can be shared by nested walks; this one only
+ * works above the frames that are on it already. */
+int parse_tree(struct hive *hive,
+               struct tree_stack *stack,
+               hive_off_t offset,
+               hive_off_t parent_off,
+               enum tree_expect expect,
+               long int expect_count,
+               struct hbin_data_block *block)
+{
+	size_t base = stack->depth;
+	int error = 0;
+
+	if (!tree_push(stack, offset, parent_off, expect, expect_count)) {
+		return 0;
 	}
+	if (block) {
+		stack->frames[stack->depth-1].block = *block;
+	}
+	while (stack->depth > base) {
+		struct tree_frame frame = stack->frames[--stack->depth];
 
-	talloc_free(mem_ctx);
+		if (!tree_visit(hive, stack, &frame)) {
+			error = 1;
+		}
+	}
+	return !error;
+}
+
+/* [SYN] Add the counters of a worker to those of the hive */
+static void tree_stack_stats(struct hive *hive, struct tree_stack *stack)
+{
+	int i;
 
-	if (error) {
+	hive->nk_fetches += stack->nk_fetches;
+	hive->nk_visits += stack->nk_visits;
+	for (i = 0; i < RECORD_KINDS; i++) {
+		hive->stats.visits[i] += stack->visits[i];
+	}
+	hive->stats.visit_bytes += stack->bytes;
+}
+
+/* [SYN] Pass 3, walk the tree from the root key, with jobs threads */
+int check_tree(TALLOC_CTX *mem_ctx, struct hive *hive, int jobs)
+{
+	struct regf_block *regf = &hive->regf;
+	struct tree_job job;
+	struct tree_task *root;
+	int i;
+
+	if (hive->cache) {
+		struct tree_stack stack;
+		int replayed;
+
+		/* [SYN] Maybe nothing in the tree changed at all */
+		memset(&stack, 0, sizeof(stack));
+		stack.logging = 1;
+		replayed = cache_replay(hive, &stack, regf->key_offset, 0);
+		if (replayed) {
+			cache_collect(hive, &stack);
+		}
+		tree_stack_free(&stack);
+		if (replayed) {
+			return 1;
+		}
+	}
+
+	if (jobs <= 1) {
+		struct tree_stack stack;
+		int rv;
+
+		memset(&stack, 0, sizeof(stack));
+		stack.logging = hive->cache != NULL;
+		rv = parse_tree(hive, &stack, regf->key_offset, 0, EXPECT_NK, 0, NULL);
+		tree_stack_stats(hive, &stack);
+		cache_collect(hive, &stack);
+		tree_stack_free(&stack);
+		return rv;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.hive = hive;
+	job.scope = report_get_scope();
+	job.arenas = talloc_zero_array(mem_ctx, struct arena *, jobs);
+	job.stacks = talloc_zero_array(mem_ctx, struct tree_stack, jobs);
+	if (!job.arenas || !job.stacks) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
 		return 0;
+	}
+	for (i = 0; i < jobs; i++) {
+		job.stacks[i].logging = hive->cache != NULL;
+	}
+	/* [SYN] talloc isn't thread safe within one hierarchy, so the arenas
+	 * hang off trees of their own. */
+	for (i = 0; i < jobs; i++) {
+		if (!(job.arenas[i] = arena_new(NULL, 0))) {
+			job.error = 1;
+		}
+	}
+	root = job.error ? NULL : arena_alloc(job.arenas[0], sizeof(struct tree_task));
+	if (!root) {
+		diag(DIAG_NOMEM, 0, 0, RECORD_UNKNOWN,
+				"Memory allocation error\n");
+		job.error = 1;
+	} else {
+		root->job = &job;
+		root->offset = regf->key_offset;
 
+		if (ws_run(jobs, tree_task_run, root)) {
+			tree_task_flush(root);
+		} else {
+			diag(DIAG_THREADS, 0, 0, RECORD_UNKNOWN,
+					"Could not start worker threads\n");
+			job.error = 1;
+		}
+	}
+
+	for (i = 0; i < jobs; i++) {
+		if (job.arenas[i]) {
+			hive->arena_allocs += job.arenas[i]->allocs;
+			talloc_free(job.arenas[i]);
+		}
+		tree_stack_stats(hive, &job.stacks[i]);
+		cache_collect(hive, &job.stacks[i]);
+		tree_stack_free(&job.stacks[i]);
 	}
-	return 1;	
+	talloc_free(job.arenas);
+	talloc_free(job.stacks);
+	return !job.error;
 }
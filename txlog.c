@@ -0,0 +1,476 @@
+/*
+ * txlog.c  --  Check regf registry files
+ *
+ * This program is not meant for end-users, but for developers and skillful
+ * system administrators. It is meant to point out regf file inconsistencies
+ * in a manner that it's easy to fix them, so that Windows will parse them
+ * correctly.
+ *
+ * Licensed under the GNU GPL v2 or any later version
+ *
+ * Copyright (C) 2010 Wilco Baan Hofman <wilco@baanhofman.nl>
+ *
+ * This file contains the transaction logs. Changes that didn't make it to
+ * the hive file yet are in REGFILE.LOG1 and REGFILE.LOG2, or REGFILE.LOG
+ * for older Windows versions. Like Windows does when it loads the hive,
+ * --logs applies them before pass 1, to the hive in memory only, so what is
+ * checked is what Windows would see. The pages they changed are remembered;
+ * with --dirty-only pass 2 only checks the records in hbins with such
+ * pages, right after a crash those are the ones that are suspect.
+ *
+ * A type 1 log holds one set of dirty sectors, which is applied if the hive
+ * wasn't written completely. A type 6 log holds a run of entries, of which
+ * those with a sequence number from the hive's on are applied, in order.
+ * Both logs of a hive are used, one may continue where the other ends.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <talloc.h>
+#include "regf.h"
+#include "chkregf.h"
+#include "config.h"
+
+#define LOG_ENTRY_ID	0x454C7648	/* [SYN] 'HvLE' */
+#define MARVIN_SEED	0x82EF4D887A4E55C5ULL
+
+struct txlog {
+	const char *path;
+	uint8_t *data;
+	uint64_t size;
+	struct regf_block regf;		/* [SYN] header of the log */
+	uint32_t first;			/* [SYN] first sequence to apply, type 6 */
+	uint32_t entries;		/* [SYN] entries from first on */
+};
+
+static uint32_t rotl32(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static void marvin_mix(uint32_t *lo, uint32_t *hi)
+{
+	*hi ^= *lo;
+	*lo = rotl32(*lo, 20);
+	*lo += *hi;
+	*hi = rotl32(*hi, 9);
+	*hi ^= *lo;
+	*lo = rotl32(*lo, 27);
+	*lo += *hi;
+	*hi = rotl32(*hi, 19);
+}
+
+/* [SYN] Marvin32, with the seed Windows uses for log entries */
+static uint64_t marvin32(const uint8_t *data, uint64_t len)
+{
+	uint32_t lo = (uint32_t)MARVIN_SEED, hi = (uint32_t)(MARVIN_SEED >> 32);
+	uint32_t word, tail = 0x80;
+	int i;
+
+	for (; len >= 4; data += 4, len -= 4) {
+		memcpy(&word, data, 4);
+		lo += word;
+		marvin_mix(&lo, &hi);
+	}
+	/* [SYN] The last bytes, padded with 0x80 */
+	for (i = len - 1; i >= 0; i--) {
+		tail = (tail << 8) | data[i];
+	}
+	lo += tail;
+	marvin_mix(&lo, &hi);
+	marvin_mix(&lo, &hi);
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* [SYN] Read a log and check its header. Returns 1 if it can be used, 0 if
+ * not and -1 if out of memory. A log that isn't there is no finding. */
+static int txlog_read(TALLOC_CTX *mem_ctx, struct txlog *log, const char *path)
+{
+	FILE *fd;
+	long size;
+
+	memset(log, 0, sizeof(*log));
+	log->path = path;
+	if (!path) {
+		return -1;
+	}
+	if (!(fd = fopen(path, "rb"))) {
+		if (errno != ENOENT) {
+			diag(DIAG_LOG_READ, 0, 0, RECORD_UNKNOWN,
+					"cannot open %s: %s\n", path, strerror(errno));
+		}
+		return 0;
+	}
+	if (fseek(fd, 0, SEEK_END) != 0 || (size = ftell(fd)) < 0 ||
+			fseek(fd, 0, SEEK_SET) != 0) {
+		diag(DIAG_LOG_READ, 0, 0, RECORD_UNKNOWN,
+				"cannot read %s: %s\n", path, strerror(errno));
+		fclose(fd);
+		return 0;
+	}
+	if (!(log->data = talloc_size(mem_ctx, size ? size : 1))) {
+		fclose(fd);
+		return -1;
+	}
+	if (fread(log->data, 1, size, fd) != size) {
+		diag(DIAG_LOG_READ, 0, 0, RECORD_UNKNOWN,
+				"short read while reading %s\n", path);
+		fclose(fd);
+		return 0;
+	}
+	fclose(fd);
+	log->size = size;
+
+	/* [SYN] An empty log is what Windows leaves after a clean shutdown */
+	if (size == 0) {
+		return 0;
+	}
+	if (size < 0x200) {
+		diag(DIAG_LOG_HEADER, 0, 0, RECORD_UNKNOWN,
+				"%s is too short for a log, not using it\n", path);
+		return 0;
+	}
+	memcpy(&log->regf, log->data, sizeof(log->regf));
+	if (log->regf.id != 0x66676572 || regf_checksum(&log->regf) != log->regf.checksum ||
+			(log->regf.version[2] != REGF_TYPE_LOG &&
+			 log->regf.version[2] != REGF_TYPE_LOG_ENTRIES) ||
+			log->regf.data_size % 0x1000 != 0) {
+		diag(DIAG_LOG_HEADER, 0, 0, RECORD_UNKNOWN,
+				"%s has no valid log header, not using it\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+/* [SYN] The entry at offset in a type 6 log, NULL at the end of the run.
+ * Warns about entries that are there, but damaged. */
+static struct log_entry *txlog_entry(struct txlog *log, uint64_t offset, int warn)
+{
+	struct log_entry *entry;
+	struct log_dirty_page *pages;
+	uint64_t used;
+	uint32_t i;
+
+	if (offset + sizeof(*entry) > log->size) {
+		return NULL;
+	}
+	entry = (struct log_entry *)(log->data + offset);
+	if (entry->id != LOG_ENTRY_ID) {
+		return NULL;
+	}
+
+	used = sizeof(*entry) + (uint64_t)entry->dirty_count * sizeof(*pages);
+	if (entry->size % 0x200 != 0 || used > entry->size ||
+			entry->size > log->size - offset ||
+			entry->data_size % 0x1000 != 0 ||
+			marvin32(log->data + offset + sizeof(*entry),
+				entry->size - sizeof(*entry)) != entry->hash1 ||
+			marvin32(log->data + offset, 0x20) != entry->hash2) {
+		if (warn) {
+			diag(DIAG_LOG_ENTRY, 0, 0, RECORD_UNKNOWN,
+					"damaged log entry at 0x%lx in %s, not applying it or what follows\n",
+					(long)offset, log->path);
+		}
+		return NULL;
+	}
+
+	/* [SYN] The pages follow the list, in its order */
+	pages = (struct log_dirty_page *)(entry + 1);
+	for (i = 0; i < entry->dirty_count; i++) {
+		used += pages[i].size;
+		if (pages[i].offset % 0x1000 != 0 || pages[i].size % 0x1000 != 0 ||
+				pages[i].size > entry->data_size ||
+				pages[i].offset > entry->data_size - pages[i].size ||
+				used > entry->size) {
+			if (warn) {
+				diag(DIAG_LOG_ENTRY, 0, 0, RECORD_UNKNOWN,
+						"log entry at 0x%lx in %s has dirty pages out of bounds, not applying it or what follows\n",
+						(long)offset, log->path);
+			}
+			return NULL;
+		}
+	}
+	return entry;
+}
+
+/* [SYN] Find the first entry of a type 6 log that the hive doesn't have */
+static void txlog_scan(struct txlog *log, uint32_t sequence)
+{
+	struct log_entry *entry;
+	uint64_t offset;
+
+	for (offset = 0x200; (entry = txlog_entry(log, offset, 1)); offset += entry->size) {
+		if (entry->sequence < sequence) {
+			continue;
+		}
+		if (!log->entries) {
+			log->first = entry->sequence;
+		} else if (entry->sequence != log->first + log->entries) {
+			break;
+		}
+		log->entries++;
+	}
+}
+
+/* [SYN] Remember that the hbin data from offset on changed */
+static int txlog_mark(struct hive *hive, uint64_t offset, uint64_t len)
+{
+	uint64_t page, end = (offset + len + 0xFFF) / 0x1000;
+
+	if (end > hive->dirty_bits) {
+		uint64_t words = (end + 63) / 64;
+		uint64_t old = (hive->dirty_bits + 63) / 64;
+		uint64_t *dirty = talloc_realloc(hive, hive->dirty, uint64_t, words);
+
+		if (!dirty) {
+			return 0;
+		}
+		memset(dirty + old, 0, (words - old) * sizeof(uint64_t));
+		hive->dirty = dirty;
+		hive->dirty_bits = words * 64;
+	}
+	for (page = offset / 0x1000; page < end; page++) {
+		if (!(hive->dirty[page / 64] & (1ULL << (page % 64)))) {
+			hive->dirty[page / 64] |= 1ULL << (page % 64);
+			hive->dirty_pages++;
+		}
+	}
+	return 1;
+}
+
+/* [SYN] Copy len bytes of hbin data into the hive */
+static int txlog_write(struct hive *hive, uint64_t offset, const uint8_t *data,
+		uint64_t len)
+{
+	if (0x1000 + offset + len > hive->size &&
+			!hive_overlay(hive, 0x1000 + offset + len)) {
+		return 0;
+	}
+	memcpy(hive->base + 0x1000 + offset, data, len);
+	return txlog_mark(hive, offset, len);
+}
+
+/* [SYN] Apply the entries of a type 6 log from sequence on. Returns the
+ * sequence after the last one applied, 0 if out of memory. */
+static uint32_t txlog_apply_entries(struct hive *hive, struct txlog *log,
+		uint32_t sequence, uint32_t *data_size)
+{
+	struct log_entry *entry;
+	uint64_t offset;
+	uint32_t applied = 0;
+
+	for (offset = 0x200; (entry = txlog_entry(log, offset, 0)); offset += entry->size) {
+		struct log_dirty_page *pages = (struct log_dirty_page *)(entry + 1);
+		const uint8_t *data = (const uint8_t *)(pages + entry->dirty_count);
+		uint32_t i;
+
+		if (entry->sequence < sequence) {
+			continue;
+		}
+		if (entry->sequence != sequence) {
+			break;
+		}
+		if (!hive_overlay(hive, 0x1000 + (uint64_t)entry->data_size)) {
+			return 0;
+		}
+		for (i = 0; i < entry->dirty_count; i++) {
+			if (!txlog_write(hive, pages[i].offset, data, pages[i].size)) {
+				return 0;
+			}
+			data += pages[i].size;
+		}
+		*data_size = entry->data_size;
+		sequence++;
+		applied++;
+	}
+	report("Applied %lu log entries from %s, sequence %lu to %lu\n",
+			(unsigned long)applied, log->path,
+			(unsigned long)(sequence - applied), (unsigned long)(sequence - 1));
+	return sequence;
+}
+
+/* [SYN] Apply the dirty sectors of a type 1 log. Returns 1 if it was
+ * applied, 0 if it couldn't be and -1 if out of memory. */
+static int txlog_apply_sectors(struct hive *hive, struct txlog *log)
+{
+	uint64_t bitmap = log->regf.data_size / 0x200 / 8;
+	uint64_t sectors = (0x204 + bitmap + 0x1FF) / 0x200 * 0x200;
+	uint64_t bit, count = 0;
+	uint32_t id = 0;
+
+	if (log->size >= 0x204) {
+		memcpy(&id, log->data + 0x200, 4);
+	}
+	if (log->size < 0x204 + bitmap || id != LOG_DIRTY_ID) {
+		diag(DIAG_LOG_HEADER, 0, 0, RECORD_UNKNOWN,
+				"%s has no dirty sector bitmap, not using it\n", log->path);
+		return 0;
+	}
+	for (bit = 0; bit < bitmap * 8; bit++) {
+		if (log->data[0x204 + bit / 8] & (1 << (bit % 8))) {
+			count++;
+		}
+	}
+	if (sectors + count * 0x200 > log->size) {
+		diag(DIAG_LOG_HEADER, 0, 0, RECORD_UNKNOWN,
+				"%s is missing dirty sectors, not using it\n", log->path);
+		return 0;
+	}
+
+	if (!hive_overlay(hive, 0x1000 + (uint64_t)log->regf.data_size)) {
+		return -1;
+	}
+	for (bit = 0; bit < bitmap * 8; bit++) {
+		if (!(log->data[0x204 + bit / 8] & (1 << (bit % 8)))) {
+			continue;
+		}
+		if (!txlog_write(hive, bit * 0x200, log->data + sectors, 0x200)) {
+			return -1;
+		}
+		sectors += 0x200;
+	}
+	report("Applied %lu dirty sectors from %s\n", (unsigned long)count, log->path);
+	return 1;
+}
+
+/* [SYN] Apply the logs next to the hive file path. Returns 0 only if out of
+ * memory; logs that can't be used are reported and left alone. */
+int txlog_apply(struct hive *hive, const char *path)
+{
+	static const char *suffixes[] = { "LOG1", "LOG2", "LOG" };
+	struct txlog logs[3], *last = NULL;
+	struct regf_block regf;
+	uint32_t sequence = 0, data_size;
+	TALLOC_CTX *mem_ctx;
+	uint8_t *view;
+	int i, rv = 1;
+
+	/* [SYN] No hive header, no logs; pass 1 will have something to say */
+	if (!(view = hive_view(hive, 0, sizeof(regf)))) {
+		return 1;
+	}
+	memcpy(&regf, view, sizeof(regf));
+	if (regf.id != 0x66676572) {
+		return 1;
+	}
+	data_size = regf.data_size;
+
+	if (!(mem_ctx = talloc_new(hive))) {
+		return 0;
+	}
+	for (i = 0; i < 3; i++) {
+		int found = txlog_read(mem_ctx, &logs[i], talloc_asprintf(mem_ctx, "%s.%s",
+					path, suffixes[i]));
+
+		if (found < 0) {
+			talloc_free(mem_ctx);
+			return 0;
+		}
+		if (!found) {
+			logs[i].regf.version[2] = REGF_TYPE_PRIMARY;
+		} else if (logs[i].regf.version[2] == REGF_TYPE_LOG_ENTRIES) {
+			/* [SYN] The second sequence number is the last written */
+			txlog_scan(&logs[i], regf.uk1[1]);
+		}
+	}
+
+	/* [SYN] Type 6: the log with the oldest entries goes first, the other
+	 * is used as far as it continues it. */
+	for (i = 0; i < 3; i++) {
+		struct txlog *log = NULL;
+		int j;
+
+		for (j = 0; j < 3; j++) {
+			if (logs[j].entries && logs[j].first + logs[j].entries > sequence &&
+					(!log || logs[j].first < log->first)) {
+				log = &logs[j];
+			}
+		}
+		if (!log || (sequence && log->first > sequence)) {
+			break;
+		}
+		if (!(sequence = txlog_apply_entries(hive, log,
+						sequence ? sequence : log->first, &data_size))) {
+			rv = 0;
+			break;
+		}
+		last = log;
+	}
+
+	/* [SYN] Type 1: only when the hive is dirty, the newest log that is
+	 * of this write or later */
+	if (rv && !last && regf.uk1[0] != regf.uk1[1]) {
+		for (i = 0; i < 3; i++) {
+			if (logs[i].regf.version[2] == REGF_TYPE_LOG &&
+					logs[i].regf.uk1[0] >= regf.uk1[1] &&
+					(!last || logs[i].regf.uk1[0] > last->regf.uk1[0])) {
+				last = &logs[i];
+			}
+		}
+		if (last) {
+			int applied = txlog_apply_sectors(hive, last);
+
+			if (applied < 0) {
+				rv = 0;
+			} else if (!applied) {
+				last = NULL;
+			} else {
+				sequence = last->regf.uk1[0];
+				data_size = last->regf.data_size;
+			}
+		}
+	}
+
+	if (rv && last) {
+		/* [SYN] The header of the log is the newer one, written back as
+		 * Windows would after recovering */
+		memcpy(&regf, &last->regf, sizeof(regf));
+		regf.version[2] = REGF_TYPE_PRIMARY;
+		regf.uk1[0] = regf.uk1[1] = sequence;
+		regf.data_size = data_size;
+		regf.checksum = regf_checksum(&regf);
+		if (!hive_overlay(hive, 0x1000 + (uint64_t)data_size)) {
+			rv = 0;
+		} else {
+			memcpy(hive->base, &regf, sizeof(regf));
+			report("%llu pages changed by the logs\n",
+					(unsigned long long)hive->dirty_pages);
+		}
+	} else if (rv) {
+		report("No log changes to apply\n");
+	}
+	talloc_free(mem_ctx);
+	return rv;
+}
+
+/* [SYN] Whether pass 2 checks the records of hbin, or only notes its cells */
+int txlog_parse_hbin(struct hive *hive, struct hbin_entry *hbin)
+{
+	uint64_t page;
+
+	if (!hive->dirty_only) {
+		return 1;
+	}
+	for (page = hbin->offset / 0x1000;
+			page < ((uint64_t)hbin->offset + hbin->size) / 0x1000 &&
+			page < hive->dirty_bits; page++) {
+		if (hive->dirty[page / 64] & (1ULL << (page % 64))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void txlog_summary(struct hive *hive, struct hbin_list *list)
+{
+	uint32_t i, count = 0;
+
+	for (i = 0; i < list->count; i++) {
+		count += txlog_parse_hbin(hive, &list->hbins[i]);
+	}
+	report("Only checking records in the %lu of %lu hbins the logs changed\n",
+			(unsigned long)count, (unsigned long)list->count);
+}